@@ -5,7 +5,152 @@
  * Description: A small shell with three built in commands: exit, cd, and
  * status. All other commands will be forked and executed using the system
  * environment path.
+ *
+ * The cheap utilities echo, true, false, pwd, export, unset, test and [ are
+ * built in as well, so they run without starting a process. Built in
+ * commands are looked up in a hash table and honor redirects by swapping the
+ * shell's own descriptors while they run.
+ *
+ * Besides < FILE and > FILE, a command can append with >> FILE, redirect any
+ * descriptor with n< FILE, n> FILE or n>> FILE, and duplicate one onto
+ * another with n>&m, as in 2>&1. Redirects are applied left to right.
+ *
+ * Inline input is given with a here-string, <<< WORD, or a here-document,
+ * << DELIM followed by lines up to one that is just DELIM. The text is kept
+ * in memory and handed to the command through a pipe, or a memfd when it is
+ * too big for the pipe.
+ *
+ * Like in bash, commands found on the PATH are remembered in a hash table so
+ * the PATH is only searched the first time a command is used. The table is
+ * emptied when PATH changes and an entry is dropped when its file is gone.
+ * The hash built in lists the table, and hash -r empties it.
+ *
+ * Commands are launched with posix_spawn by default. Set the environment
+ * variable SMALLSH_ENGINE to "fork" to launch them with fork and exec instead,
+ * or to "spawn" to ask for posix_spawn explicitly. Commands can be chained
+ * with | into a pipeline, and SMALLSH_PIPE_SIZE sets the capacity in bytes of
+ * the pipes between the stages.
+ *
+ * Background jobs are reaped as soon as they finish. SIGCHLD is blocked and
+ * read through a signalfd that is polled together with the input, so the
+ * shell reports a finished job even while it sits idle at the prompt.
+ *
+ * Run as smallsh SCRIPT to run the commands in a file. The script is mapped
+ * into memory and its lines are run in place, with no prompt. When stdin
+ * isn't a terminal it is read the same way, mapped if it is a regular file
+ * and read in large chunks otherwise. Neither lines nor argument lists have
+ * a fixed limit, the buffers grow to fit them, so a command can take as
+ * many arguments as ARG_MAX allows.
+ *
+ * The parallel built in runs a file of command lines as background jobs,
+ * at most N at a time: parallel [-j N] [FILE]. It reads stdin when there is
+ * no FILE, and N defaults to the number of CPUs.
+ *
+ * When the shell owns the terminal it does job control. Every job runs in
+ * its own process group, which is handed the terminal while it runs in the
+ * foreground. ^Z stops the foreground job and puts it in the job table,
+ * jobs lists the table, fg [N] continues a job in the foreground and bg [N]
+ * continues it in the background.
+ *
+ * Interactive sessions keep a history of the lines they ran. !! reruns the
+ * last line and !N line N, and the history built in lists them. Every line
+ * is appended to SMALLSH_HISTFILE, ~/.smallsh_history by default, with a
+ * single write. The file is only read the first time the history is used,
+ * and only the last SMALLSH_HISTSIZE lines, 1000 by default, are kept.
+ *
+ * A line can hold a list of commands separated by ;, &&, || and &. A
+ * command after && only runs if the one before it succeeded, after || only
+ * if it failed, and a command followed by & runs in the background.
+ *
+ * Before a command is split into words, $$ is replaced by the shell's pid, $?
+ * by the exit code of the last command and $NAME or ${NAME} by the value of
+ * the environment variable, or nothing if it isn't set. $(COMMAND) is
+ * replaced by the output of the command, which runs in a forked copy of the
+ * shell and is read through a pipe straight into the expanded line, where
+ * it splits into words like everything else. Substitutions can be nested.
+ *
+ * The wait built in blocks on the signalfd until background jobs finish:
+ * wait [-n] [-t SECONDS] [PID | %N ...]. With no jobs given it waits for
+ * all of them, with -n only for the first one to finish, and -t gives up
+ * with exit code 124 once the time is up.
+ *
+ * Every descriptor the shell opens is close on exec, so children only get
+ * 0, 1, 2 and the ones they were redirected. Set SMALLSH_CLOSE_FDS to 1 to
+ * also close whatever the shell itself inherited above 2 in every child.
+ *
+ * Set SMALLSH_CAPTURE to a number of bytes to capture the output of
+ * background jobs instead of letting it mix with ours. Each job's stdout and
+ * stderr go to a pipe that the shell drains through one epoll instance, into
+ * a ring that keeps the last SMALLSH_CAPTURE bytes. output lists the
+ * captures and output PID or output %N prints one, dropping it once the job
+ * is done.
+ *
+ * The ulimit built in sets resource limits for the jobs, not for the shell,
+ * which every child applies with setrlimit before it runs its command. With
+ * SMALLSH_CGROUP naming a cgroup v2 directory we may write to, ulimit --cpus
+ * N and --mem BYTES also put every job in a cgroup of its own under it with
+ * those caps, cloned straight into it with clone3 where the kernel can.
+ * Limited jobs are always forked, since posix_spawn can't do either.
+ *
+ * Prefix a command line with pin CPUS, as in pin 0-7,16 cmd, to run the job
+ * on those CPUs only and prefer memory on their NUMA nodes. Set SMALLSH_PIN
+ * to cpu or node to spread the background jobs that aren't pinned, parallel
+ * ones included, over the CPUs or the NUMA nodes in turn. The shell moves
+ * itself there while it starts the job and back afterwards, so both engines
+ * hand the placement down.
+ *
+ * When the shell exits, the jobs still running get SIGTERM and
+ * SMALLSH_SHUTDOWN seconds, 5 by default, to finish while they are reaped as
+ * usual. Whatever is left after that is killed and reported. Set it to 0 to
+ * kill them right away.
+ *
+ * Words with *, ? or [ in them are expanded against the file system by the
+ * shell itself, in sorted order, and kept as they are when nothing matches.
+ * Directory listings are cached and reread only when the directory's mtime
+ * changes, so repeated globs over the same directories cost a stat each.
+ *
+ * Set SMALLSH_EVENTS to a file, or to the number of an open descriptor, to
+ * get a JSON line for every job that starts, exits or dies of a signal, every
+ * redirect that fails and every job killed on exit, stamped with the
+ * monotonic clock. The lines are buffered and written when the shell is
+ * about to wait for input, exits or has EVENT_BUFFER bytes of them.
+ *
+ * alias NAME=WORDS makes WORDS stand in for NAME at the start of
+ * a command, and function NAME { COMMANDS } defines a function, whose body
+ * may also go on over the lines up to a closing }. Functions get their
+ * arguments as $1 to $9, $# and $@ and run in the shell like built ins. Both
+ * are parsed once when they are defined: the commands of a function that
+ * have nothing to expand run straight from their parsed form, and only the
+ * others are expanded and tokenized again on every call.
+ *
+ * for NAME in WORDS ; do COMMANDS ; done and while COMMANDS ; do COMMANDS ;
+ * done loop, on one line or over several. A loop is compiled the same way
+ * before it first runs, so its passes never read or tokenize it again. The
+ * words of a for loop are expanded once, when it starts. A while loop goes
+ * on while its condition ends with a status of 0, and since status leaves
+ * the status alone, while status ; do tests the command before the loop.
+ *
+ * Children are reaped with wait4, and the wall clock time, CPU time, peak
+ * memory and context switches of every job are recorded. Prefix a command
+ * line with time to have them printed when it finishes, and run jobs --stats
+ * for percentiles over the whole session.
+ *
+ * Run as smallsh --serve SOCKET to serve command lines on a Unix socket
+ * instead. SMALLSH_WORKERS shells, one per CPU by default, are forked ready
+ * to go and each serves one connection at a time, so clients don't pay for
+ * starting a shell. Every connection gets a fork of its worker, so one
+ * client's directory, variables, functions and jobs never reach the next.
+ * A client sends lines, optionally with its stdin, stdout
+ * and stderr attached as SCM_RIGHTS, and every line is answered with a null
+ * byte, its exit code and a newline. Commands of a line sent without
+ * descriptors read /dev/null and write to the connection.
+ *
+ * smallsh_bench.c measures the launch rate, the parser and how fast jobs are
+ * reaped, and can compare builds of the shell side by side.
+ * smallsh_test.c checks behaviour the benchmarks don't, like numbered
+ * redirects landing on the right descriptors under both engines.
  *****************************************************************************/
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -15,416 +160,6464 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <spawn.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/sched.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <stdarg.h>
+
+// Launch engines used by handle_fork_exec
+#define ENGINE_FORK 0
+#define ENGINE_SPAWN 1
+
+// How background jobs are spread over the machine when they aren't pinned
+#define PIN_NONE 0
+#define PIN_CPU 1
+#define PIN_NODE 2
+// Bits in the NUMA node masks we hand to the kernel
+#define MAX_NODES 1024
+
+// Size of the built in command hash table, a power of two
+#define BUILTIN_INDEX_SIZE 32
+// Number of buckets in the resolved command cache, a power of two
+#define PATH_CACHE_SIZE 256
+// Number of directory listings kept for globbing
+#define DIR_CACHE_SIZE 16
+// Buckets of the alias and function table, a power of two
+#define DEFINITION_TABLE_SIZE 64
+// How deep functions may call each other before we give up
+#define FUNCTION_DEPTH 256
+
+// How a command of a list is joined to the one before it
+#define LIST_ALWAYS 0
+#define LIST_AND 1
+#define LIST_OR 2
+
+// Kinds of redirect
+#define REDIRECT_FILE 0
+#define REDIRECT_DUP 1
+#define REDIRECT_HEREDOC 2
+#define REDIRECT_HERESTRING 3
+
+// Input buffer sizes and arena sizing, buffers grow past these as needed
+#define LINE_CHUNK 2048
+#define SCRIPT_CHUNK 65536
+#define INITIAL_ARGS 16
+#define ARENA_BLOCK_SIZE 8192
+// Number of history lines kept by default
+#define HISTORY_SIZE 1000
+// Seconds jobs get to exit after SIGTERM when the shell exits, by default
+#define SHUTDOWN_GRACE 5
+// how many bytes of events are buffered before they are written
+#define EVENT_BUFFER 16384
+// the lowest descriptor the shell keeps for itself, the ones below are left
+// to redirects like 3>file
+#define SHELL_FDS 10
+
+extern char ** environ;
+
+// A block of arena memory, blocks are chained and reused across lines
+struct arena_block {
+	struct arena_block * next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+// A bump allocator that is rewound between command lines
+struct arena {
+	struct arena_block * head;
+	struct arena_block * current;
+};
+
+// How far an arena was used, to rewind it to later
+struct arena_mark {
+	struct arena_block * block;
+	size_t used;
+};
+
+// Buffered input read straight from a file descriptor, so that we can tell
+// when a whole line is waiting without going through stdio. Scripts that
+// are regular files are mapped instead, and then buf is the whole file.
+struct line_reader {
+	int fd;
+	char * buf;
+	// the unread bytes are buf[start] up to buf[end]
+	size_t start;
+	size_t end;
+	// bytes buf can hold, one more is always allocated for a null
+	size_t size;
+	int mapped;
+	// whether to prompt
+	int interactive;
+	// copy of a mapped file's last line when it has no room for a null
+	char * tail;
+	// whether the input is a client connection that may send descriptors
+	// along, and the ones that came with the line being read, -1 if none
+	int receives_fds;
+	int passed[3];
+	// how many lines have been returned, so the last one's number
+	long lines;
+};
+
+// A redirect of one descriptor of a command, to a file opened with the
+// flags, to a copy of the source descriptor, or to inline text
+struct redirect {
+	int type;
+	int fd;
+	int flags;
+	char * filename;
+	int source;
+	// the text of a here-document or here-string, and the line that ends
+	// a here-document
+	char * body;
+	size_t body_length;
+	char * delimiter;
+	struct redirect * next;
+};
+
+// A parsed command. The words point straight into the input buffer.
+struct command {
+	char ** argv;
+	int argc;
+	// the redirects in the order they were given
+	struct redirect * redirects;
+	int num_redirects;
+};
+
+// A parsed command line, the commands are connected by pipes
+struct pipeline {
+	struct command * cmds;
+	int num_cmds;
+	int fg;
+	// which job of a parallel batch this is, -1 if it isn't in one
+	int batch_index;
+	// whether to print the resource usage when the job is done
+	int timed;
+	// the CPUs pin put the job on, NULL if it wasn't pinned
+	cpu_set_t * cpus;
+};
+
+// One command of a list, still unexpanded
+struct list_item {
+	char * text;
+	int connector;
+};
+
+// The commands of a line, in the order they run
+struct command_list {
+	struct list_item * items;
+	int count;
+};
+
+struct shell;
+
+// A command that runs inside the shell. run returns the exit code.
+struct builtin {
+	const char * name;
+	int (*run)(struct shell *, char **);
+	// whether the exit code becomes the shell's status
+	int sets_status;
+};
+
+// How one stage of a pipeline gets launched
+struct stage {
+	struct command * cmd;
+	// set when the stage is a built in, which is run in a forked child
+	struct builtin * builtin;
+	// the resolved executable otherwise
+	const char * path;
+	int fg;
+	// pipe ends to use for stdin and stdout, -1 if there is none
+	int in_fd;
+	int out_fd;
+	// whether the job gets its own process group, and the group to join
+	// (0 means this stage leads a new one)
+	int new_group;
+	pid_t pgid;
+	// whether the job's group should be given the terminal
+	int take_terminal;
+	// the pipe the job's output is captured in, -1 if it isn't
+	int capture_fd;
+	// the job's cgroup directory, -1 if it doesn't have one
+	int cgroup_fd;
+};
+
+// What a finished job cost. The CPU times and context switches are summed
+// over its processes, the memory is the largest of them.
+struct job_sample {
+	double wall;
+	double user;
+	double sys;
+	long max_rss;
+	long switches;
+};
+
+// Every job that finished this session
+struct job_stats {
+	struct job_sample * samples;
+	int count;
+	int capacity;
+};
+
+// A job, one per pipeline that is running or stopped. Unused slots are
+// chained on the job table's free list through next_free.
+struct job {
+	int in_use;
+	int next_free;
+	pid_t pgid;
+	pid_t * pids;
+	int num_pids;
+	// processes of the job that haven't been reaped yet
+	int live;
+	// status of the last stage, once it has been reaped
+	int status;
+	// which job of a parallel batch this is, -1 if it isn't in one
+	int batch_index;
+	// when the job started and what it has used so far
+	struct timespec started;
+	struct job_sample usage;
+	int timed;
+	// whether the job was stopped and hasn't been continued since
+	int stopped;
+	// the cgroup the job was put in, NULL if it wasn't
+	char * cgroup;
+};
+
+// An entry of the pid index, pid 0 marks an empty slot
+struct pid_slot {
+	pid_t pid;
+	int job;
+};
+
+// The background jobs, with an open addressing hash index from each child
+// pid to its job so that reaping never scans the table
+struct job_table {
+	struct job * jobs;
+	int capacity;
+	int free_list;
+	int num_jobs;
+	struct pid_slot * index;
+	int index_capacity;
+	int index_used;
+	// results of the running parallel batch and how many of its jobs are
+	// still going
+	int * batch_status;
+	int batch_running;
+	// the job fg and bg pick when they aren't given one
+	int current;
+};
+
+// Settings read from the environment when the shell starts
+struct shell_options {
+	int engine;
+	int pipe_size;
+	// whether the shell owns its controlling terminal
+	int terminal;
+	// whether children get every descriptor above 2 closed that they
+	// weren't redirected
+	int close_fds;
+	// where the history is kept and how many lines of it, NULL when there
+	// is no history file
+	char * history_file;
+	int history_size;
+	// how many workers serve a socket in server mode
+	int workers;
+	// bytes of output kept for every background job, 0 to not capture it
+	size_t capture_size;
+	// the cgroup that jobs get a cgroup of their own under, or NULL
+	char * cgroup_root;
+	// how background jobs are spread over the CPUs, one of the PIN_ values
+	int pin;
+	// seconds between SIGTERM and SIGKILL for the jobs left when we exit
+	double shutdown;
+	// where the event log goes, -1 when there is none
+	int event_fd;
+};
+
+// Text that grows as it is appended to, reused from line to line
+struct text_buffer {
+	char * data;
+	size_t length;
+	size_t capacity;
+};
+
+// Events of the jobs as JSON lines, buffered until we would block anyway or
+// there are EVENT_BUFFER bytes of them
+struct event_log {
+	int fd;
+	// the shell the events are from
+	pid_t shell;
+	struct text_buffer buffer;
+};
+
+// The last lines that were run, entry n lives at ring[n % capacity]. The
+// lines of this session are in the ring right away, the ones from the file
+// are only put in front of them once the history is first used.
+struct history {
+	char ** ring;
+	int capacity;
+	// number of entries so far, the newest one is count
+	long count;
+	// the history file open for appending, -1 if there is none
+	int fd;
+	// how long the file was before this session
+	off_t file_start;
+	int loaded;
+};
+
+// The names in a directory, sorted, and what the directory looked like
+// when they were read
+struct dir_listing {
+	char * path;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	// whether the directory changed so close to the read that a change right
+	// after it might not show in the mtime
+	int racy;
+	char ** names;
+	int count;
+};
+
+// Directories that globs were matched against lately, reused for as long as
+// the directory's mtime says nothing was added or removed
+struct dir_cache {
+	struct dir_listing listings[DIR_CACHE_SIZE];
+	// the listing to replace next
+	int next;
+};
+
+// The paths a glob matched, in the arena
+struct glob_matches {
+	char ** paths;
+	int count;
+	int capacity;
+};
+
+// A command name and where we found it on the PATH
+struct path_entry {
+	struct path_entry * next;
+	char * name;
+	char * path;
+};
+
+// Resolved commands, valid for the PATH they were resolved with
+struct path_cache {
+	struct path_entry * buckets[PATH_CACHE_SIZE];
+	char * path_var;
+	int num_entries;
+};
+
+struct loop;
+
+// Commands that are split up once and run any number of times. The
+// commands that need no expansion are parsed already and loops are
+// compiled, the others have neither and are expanded and parsed every time
+// they run.
+struct compiled_list {
+	struct command_list list;
+	struct pipeline ** parsed;
+	struct loop ** loops;
+};
+
+// A for or while loop, with the variable and the words of a for loop
+struct loop {
+	int is_for;
+	char * name;
+	char * words;
+	struct compiled_list condition;
+	struct compiled_list body;
+};
+
+// An alias or a function, parsed once when it is defined. Everything it
+// owns lives in its own arena.
+struct definition {
+	struct definition * next;
+	char * name;
+	int is_alias;
+	// the words an alias stands for
+	struct command * alias;
+	// the commands of a function and the text they were defined with
+	struct compiled_list body;
+	char * text;
+	// how many calls of the function are running
+	int calls;
+	struct arena arena;
+};
+
+// The aliases and functions by name
+struct definition_table {
+	struct definition * buckets[DEFINITION_TABLE_SIZE];
+	int count;
+};
+
+// Limits the ulimit built in set for the jobs we start, the shell itself
+// keeps its own
+struct job_limits {
+	// the resource limits to set in every child, where set isn't 0
+	int set[RLIM_NLIMITS];
+	rlim_t value[RLIM_NLIMITS];
+	int any;
+	// how many CPUs and bytes of memory each job's cgroup gets, 0 for no cap
+	double cpus;
+	long long memory;
+	// how many job cgroups have been made, which names the next one
+	unsigned long num_cgroups;
+};
+
+// Where the shell itself runs and what the machine's NUMA nodes are, read
+// the first time a job is pinned, and where the next spread job goes
+struct placement {
+	int loaded;
+	cpu_set_t allowed;
+	int saved_mode;
+	unsigned long saved_nodes[MAX_NODES / (8 * sizeof(unsigned long))];
+	// the CPUs of every node and the node's number, none without NUMA
+	int num_nodes;
+	cpu_set_t * node_cpus;
+	int * node_ids;
+	int next;
+};
+
+// The output of a background job, read from a pipe into a ring that keeps
+// the last bytes of it
+struct capture {
+	// the job's first pid, which names the capture
+	pid_t pid;
+	// read end of the pipe, -1 once every writer has closed it
+	int fd;
+	char * ring;
+	size_t start;
+	size_t length;
+	// bytes that were pushed out of the ring to make room
+	unsigned long dropped;
+};
+
+// Every capture that hasn't been dumped since its job finished, with one
+// epoll instance watching all of their pipes
+struct capture_table {
+	struct capture * captures;
+	int count;
+	int capacity;
+	// how many of them still have their pipe open
+	int num_open;
+	int epoll_fd;
+	size_t ring_size;
+};
+
+// Everything the shell keeps track of between command lines
+struct shell {
+	int status;
+	// the SIGINT ignoring action, children reset it from this
+	struct sigaction act;
+	struct shell_options opts;
+	struct job_table jobs;
+	struct line_reader reader;
+	struct arena arena;
+	// signalfd that reports finished children
+	int signal_fd;
+	// hashed lookup of the built in commands
+	struct builtin * builtin_index[BUILTIN_INDEX_SIZE];
+	// where the commands we have run live
+	struct path_cache commands;
+	// resource usage of every finished job
+	struct job_stats stats;
+	// the lines typed this session and before, when we are interactive
+	struct history history;
+	int has_history;
+	// the line after variable expansion
+	struct text_buffer expanded;
+	// output of the background jobs, when it is captured
+	struct capture_table captures;
+	// what the jobs may use
+	struct job_limits limits;
+	// which CPUs and memory the jobs run on
+	struct placement placement;
+	// listings of the directories we globbed in
+	struct dir_cache dirs;
+	// what the jobs did, for whoever watches the shell
+	struct event_log events;
+	// the aliases and functions, and the arguments of the function that is
+	// running with the function name first
+	struct definition_table definitions;
+	char ** args;
+	int num_args;
+	int call_depth;
+	// set in a forked copy of the shell, which holds none of the jobs
+	int forked;
+};
 
 // Function declarators
-void exit_shell(int*, pid_t *, int*);
+void exit_shell(struct shell *);
+void signal_job(struct job *, int);
 void get_status(int*);
-void handle_fork_exec(int*, int, struct sigaction, char *, char *, char **, pid_t *, int*);
-void prompt(char *);
-void change_directory(char **);
-char ** create_char_array(int, int);
-void delete_char_array(char **, int);
-void run_shell();
-void wait_for_children(int*, pid_t*, int *);
-char ** reset_command_array(char **, int, int);
+int handle_fork_exec(struct shell *, struct pipeline *);
+void exec_child(struct shell *, struct stage *);
+pid_t spawn_child(struct shell *, struct stage *);
+const char * resolve_command(struct shell *, const char *);
+void forget_command(struct shell *, const char *);
+void clear_path_cache(struct path_cache *);
+void load_options(struct shell_options *);
+char * prompt(struct shell *);
+char * next_line(struct line_reader *);
+void reader_init(struct line_reader *, int, int);
+void reader_free(struct line_reader *);
+ssize_t reader_fill(struct line_reader *);
+char * reader_rest(struct line_reader *);
+char * reader_next(struct line_reader *);
+ssize_t receive_input(struct line_reader *, char *, size_t);
+void take_passed(struct line_reader *, int *);
+int setup_reaper();
+int shell_fd(int);
+int drain_signals(int);
+void run_command(struct shell *, struct pipeline *);
+void builtin_index_init(struct shell *);
+struct builtin * find_builtin(struct shell *, const char *);
+unsigned int string_hash(const char *);
+void run_builtin(struct shell *, struct builtin *, struct command *);
+int swap_fd(int, struct redirect *, int *);
+void restore_fd(int, int);
+int builtin_cd(struct shell *, char **);
+int builtin_status(struct shell *, char **);
+int builtin_exit(struct shell *, char **);
+int builtin_echo(struct shell *, char **);
+int builtin_true(struct shell *, char **);
+int builtin_false(struct shell *, char **);
+int builtin_pwd(struct shell *, char **);
+int builtin_export(struct shell *, char **);
+int builtin_unset(struct shell *, char **);
+int builtin_test(struct shell *, char **);
+int builtin_hash(struct shell *, char **);
+int builtin_parallel(struct shell *, char **);
+int builtin_jobs(struct shell *, char **);
+int builtin_wait(struct shell *, char **);
+int exit_code(int);
+int builtin_history(struct shell *, char **);
+int builtin_alias(struct shell *, char **);
+int builtin_unalias(struct shell *, char **);
+int builtin_call(struct shell *, char **);
+int define_function(struct shell *, char *);
+int body_closed(struct text_buffer *);
+int list_continues(struct text_buffer *);
+struct definition * find_definition(struct shell *, const char *);
+struct definition * add_definition(struct shell *, const char *, int);
+int remove_definition(struct shell *, const char *);
+void definition_free(struct definition *);
+void expand_aliases(struct shell *, struct arena *, struct pipeline *);
+void run_compiled(struct shell *, struct compiled_list *);
+int compile_list(struct shell *, struct arena *, char *, struct compiled_list *);
+int compile_loop(struct shell *, struct arena *, char *, struct loop *);
+void run_loop(struct shell *, struct loop *);
+int interrupted(sigset_t *);
+char * scan_word(char *, char **, size_t *);
+int loop_depth(char *, char **);
+int is_loop(char *);
+int is_keyword(const char *, size_t, const char *);
+int starts_command(const char *, size_t);
+int valid_variable(const char *);
+int read_continued(struct shell *, struct text_buffer *);
+int valid_name(const char *);
+int builtin_output(struct shell *, char **);
+int capture_open(struct capture_table *, int *);
+void capture_remove(struct capture_table *, int);
+void capture_free(struct capture_table *);
+int builtin_ulimit(struct shell *, char **);
+int parse_limit(const char *, rlim_t, rlim_t *);
+int parse_cpus(const char *, double *);
+void apply_limits(struct job_limits *);
+char * job_cgroup(struct shell *, int *);
+int cgroup_write(const char *, const char *, const char *);
+pid_t fork_into(int);
+int parse_cpu_list(const char *, cpu_set_t *);
+void placement_load(struct placement *);
+cpu_set_t * next_placement(struct shell *, cpu_set_t *);
+int place_shell(struct shell *, cpu_set_t *);
+void glob_pipeline(struct shell *, struct pipeline *);
+int has_glob(const char *);
+void glob_walk(struct shell *, char *, size_t, const char *, struct glob_matches *);
+struct dir_listing * list_directory(struct dir_cache *, const char *);
+void dir_listing_free(struct dir_listing *);
+int compare_strings(const void *, const void *);
+int drain_captures(struct capture_table *);
+int wait_for_output(struct shell *);
+void history_init(struct history *, struct shell_options *);
+void history_load(struct history *);
+void history_push(struct history *, char *);
+void history_add(struct history *, const char *);
+const char * history_get(struct history *, long);
+void history_free(struct history *);
+char * expand_history(struct shell *, char *);
+char * expand_variables(struct shell *, struct text_buffer *, char *);
+int expand_pipeline(struct shell *, struct text_buffer *, struct arena *, struct pipeline *);
+char ** expand_words(struct shell *, struct text_buffer *, struct arena *, char **, int, int *);
+void text_append(struct text_buffer *, const char *, size_t);
+void text_reserve(struct text_buffer *, size_t);
+int event_begin(struct event_log *, const char *);
+void event_printf(struct event_log *, const char *, ...);
+void event_string(struct event_log *, const char *);
+void event_end(struct event_log *);
+void events_flush(struct event_log *);
+void event_spawn(struct shell *, int, struct pipeline *);
+void event_done(struct shell *, int);
+void event_redirect(struct shell *, struct command *, struct redirect *, int);
+char * substitution_end(char *);
+int substitute(struct shell *, struct text_buffer *, char *, size_t);
+void become_copy(struct shell *);
+int builtin_fg(struct shell *, char **);
+int builtin_bg(struct shell *, char **);
+int find_job(struct shell *, const char *, const char *);
+void wait_job(struct shell *, int, int);
+int job_changed(struct job_table *, pid_t, int);
+int evaluate_test(int, char **);
+void * arena_alloc(struct arena *, size_t);
+void arena_reset(struct arena *);
+struct arena_mark arena_save(struct arena *);
+void arena_rewind(struct arena *, struct arena_mark *);
+void arena_free(struct arena *);
+char * next_token(char **);
+int parse_pipeline(char *, struct arena *, struct pipeline *);
+int split_list(char *, struct arena *, struct command_list *);
+void run_list(struct shell *, struct command_list *);
+int parse_redirect(const char *, struct redirect *, struct arena *);
+int open_redirect(struct redirect *);
+int reads_input(struct command *);
+void set_redirect_word(struct redirect *, char *, struct arena *);
+int open_body(const char *, size_t);
+void read_heredocs(struct line_reader *, struct arena *, struct pipeline *);
+int has_heredoc(const char *);
+char * arena_strdup(struct arena *, const char *);
+char * arena_strndup(struct arena *, const char *, size_t);
+void close_redirects(struct command *, int *, int);
+int kept_fds(struct command *, int *);
+void run_shell(char *);
+void shell_init(struct shell *);
+void run_line(struct shell *, char *);
+void run_server(const char *);
+int listen_on(const char *);
+pid_t start_worker(struct shell *, int);
+void serve_connection(struct shell *, int);
+char * next_request(struct shell *);
+int wait_for_children(struct shell *);
+void job_table_init(struct job_table *);
+void job_table_free(struct job_table *);
+int job_add(struct job_table *, pid_t *, int, pid_t, int);
+int job_reaped(struct job_table *, pid_t, int, struct rusage *);
+void add_usage(struct job_sample *, struct rusage *);
+double seconds_since(struct timespec *);
+void record_sample(struct shell *, struct job_sample *);
+void report_time(struct job_sample *);
+int compare_doubles(const void *, const void *);
+void print_percentiles(const char *, double *, int);
+unsigned int pid_hash(pid_t, int);
+void pid_index_insert(struct job_table *, pid_t, int);
+int pid_index_find(struct job_table *, pid_t);
+void pid_index_remove(struct job_table *, int);
+void pid_index_resize(struct job_table *, int);
+
+/******************************************************************************
+ * int wait_for_children(struct shell *)
+ * 
+ * Waits for any child process that hasn't completed yet. Jobs of a parallel
+ * batch are recorded quietly in the batch results instead of being reported.
+ * Jobs that were stopped or continued by someone else are marked as such.
+ * Returns whether anything was reported.
+ * The resource usage of every job that is done goes into the session stats.
+ *****************************************************************************/
+int wait_for_children(struct shell * sh){
+	struct job_table * jobs = &sh->jobs;
+	struct rusage usage;
+	int child_status;
+	int reported = 0;
+	pid_t pid = wait4(-1, &child_status, WNOHANG | WUNTRACED | WCONTINUED, &usage);
+	while(pid > 0){
+		if(WIFSTOPPED(child_status) || WIFCONTINUED(child_status)){
+			// the job is still there, it only changed state
+			reported |= job_changed(jobs, pid, child_status);
+			pid = wait4(-1, &child_status, WNOHANG | WUNTRACED | WCONTINUED, &usage);
+			continue;
+		}
+		// drop the pid from its job, this is a hash lookup. The slot may be
+		// free again afterwards, but it stays untouched until the next add.
+		int slot = job_reaped(jobs, pid, child_status, &usage);
+		if(slot < 0 || jobs->jobs[slot].batch_index < 0){
+			sh->status = child_status;
+			printf("Background process %d closed\n", pid);
+			get_status(&sh->status);
+			reported = 1;
+		}
+		if(slot >= 0 && !jobs->jobs[slot].in_use){
+			// that was the last process of the job
+			struct job * job = &jobs->jobs[slot];
+			job->usage.wall = seconds_since(&job->started);
+			record_sample(sh, &job->usage);
+			event_done(sh, slot);
+			if(job->timed)
+				report_time(&job->usage);
+		}
+		pid = wait4(-1, &child_status, WNOHANG | WUNTRACED | WCONTINUED, &usage);
+	}
+	return reported;
+}
+
+/******************************************************************************
+ * void job_table_init(struct job_table *)
+ * 
+ * Sets up an empty job table with a few slots and an empty pid index.
+ *****************************************************************************/
+void job_table_init(struct job_table * jobs){
+	jobs->capacity = 0;
+	jobs->jobs = NULL;
+	jobs->free_list = -1;
+	jobs->num_jobs = 0;
+	jobs->index = NULL;
+	jobs->index_capacity = 0;
+	jobs->index_used = 0;
+	jobs->batch_status = NULL;
+	jobs->batch_running = 0;
+	jobs->current = -1;
+	pid_index_resize(jobs, 16);
+}
+
+/******************************************************************************
+ * void job_table_free(struct job_table *)
+ * 
+ * Frees the job table and everything it owns.
+ *****************************************************************************/
+void job_table_free(struct job_table * jobs){
+	int i = 0;
+	for(; i < jobs->capacity; i++){
+		if(jobs->jobs[i].in_use){
+			free(jobs->jobs[i].pids);
+			free(jobs->jobs[i].cgroup);
+		}
+	}
+	free(jobs->jobs);
+	free(jobs->index);
+	jobs->jobs = NULL;
+	jobs->index = NULL;
+	jobs->capacity = 0;
+	jobs->index_capacity = 0;
+}
+
+/******************************************************************************
+ * int job_add(struct job_table *, pid_t *, int, pid_t, int)
+ * 
+ * Records a job made of the given processes, as the given job of
+ * a parallel batch or -1. Takes a slot off the free list, or doubles the
+ * table when there is none, and indexes every pid. Returns the slot of the
+ * job.
+ *****************************************************************************/
+int job_add(struct job_table * jobs, pid_t * pids, int num_pids, pid_t pgid, int batch_index){
+	int slot;
+	int i;
+	if(jobs->free_list < 0){
+		// no free slots left, grow the table and chain the new slots
+		int capacity = jobs->capacity ? 2 * jobs->capacity : 8;
+		struct job * grown = realloc(jobs->jobs, capacity * sizeof(struct job));
+		if(grown == NULL){
+			fprintf(stderr, "smallsh: out of memory\n");
+			exit(1);
+		}
+		for(i = capacity - 1; i >= jobs->capacity; i--){
+			grown[i].in_use = 0;
+			grown[i].next_free = jobs->free_list;
+			jobs->free_list = i;
+		}
+		jobs->jobs = grown;
+		jobs->capacity = capacity;
+	}
+	slot = jobs->free_list;
+	struct job * job = &jobs->jobs[slot];
+	jobs->free_list = job->next_free;
+	jobs->num_jobs++;
+	job->in_use = 1;
+	job->pgid = pgid;
+	job->status = 0;
+	job->batch_index = batch_index;
+	memset(&job->usage, 0, sizeof(job->usage));
+	job->timed = 0;
+	job->stopped = 0;
+	job->cgroup = NULL;
+	job->num_pids = 0;
+	job->pids = malloc(num_pids * sizeof(pid_t));
+	for(i = 0; i < num_pids; i++){
+		// stages that never started have no pid
+		if(pids[i] <= 0)
+			continue;
+		job->pids[job->num_pids++] = pids[i];
+		pid_index_insert(jobs, pids[i], slot);
+	}
+	job->live = job->num_pids;
+	jobs->current = slot;
+	return slot;
+}
+
+/******************************************************************************
+ * int job_reaped(struct job_table *, pid_t, int, struct rusage *)
+ * 
+ * Marks a process as reaped with the given status and adds what it used to
+ * its job, if that is known. Once the last process of
+ * a job is gone the job's slot goes back on the free list, and a job of a
+ * parallel batch hands its status over to the batch. Returns the slot of the
+ * job the pid belonged to, or -1 if it isn't one of ours.
+ *****************************************************************************/
+int job_reaped(struct job_table * jobs, pid_t pid, int status, struct rusage * usage){
+	int pos = pid_index_find(jobs, pid);
+	if(pos < 0)
+		return -1;
+	int slot = jobs->index[pos].job;
+	struct job * job = &jobs->jobs[slot];
+	pid_index_remove(jobs, pos);
+	if(usage != NULL)
+		add_usage(&job->usage, usage);
+	// the job's status comes from the last stage
+	if(job->pids[job->num_pids - 1] == pid)
+		job->status = status;
+	job->live--;
+	if(job->live == 0){
+		if(job->batch_index >= 0){
+			jobs->batch_status[job->batch_index] = job->status;
+			jobs->batch_running--;
+		}
+		// the whole job is done, give the slot back
+		if(job->cgroup != NULL){
+			rmdir(job->cgroup);
+			free(job->cgroup);
+			job->cgroup = NULL;
+		}
+		free(job->pids);
+		job->pids = NULL;
+		job->in_use = 0;
+		job->next_free = jobs->free_list;
+		jobs->free_list = slot;
+		jobs->num_jobs--;
+	}
+	return slot;
+}
+
+/******************************************************************************
+ * int job_changed(struct job_table *, pid_t, int)
+ * 
+ * Records that a process of a job was stopped or continued. Returns whether
+ * a newly stopped job was reported.
+ *****************************************************************************/
+int job_changed(struct job_table * jobs, pid_t pid, int status){
+	int pos = pid_index_find(jobs, pid);
+	struct job * job;
+	if(pos < 0)
+		return 0;
+	job = &jobs->jobs[jobs->index[pos].job];
+	if(WIFSTOPPED(status) && !job->stopped){
+		job->stopped = 1;
+		jobs->current = jobs->index[pos].job;
+		printf("Job %d stopped by signal %d\n", jobs->index[pos].job + 1, WSTOPSIG(status));
+		return 1;
+	}
+	if(WIFCONTINUED(status))
+		job->stopped = 0;
+	return 0;
+}
+
+/******************************************************************************
+ * void add_usage(struct job_sample *, struct rusage *)
+ * 
+ * Adds the resource usage of a reaped process to its job's sample.
+ *****************************************************************************/
+void add_usage(struct job_sample * sample, struct rusage * usage){
+	sample->user += usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6;
+	sample->sys += usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+	if(usage->ru_maxrss > sample->max_rss)
+		sample->max_rss = usage->ru_maxrss;
+	sample->switches += usage->ru_nvcsw + usage->ru_nivcsw;
+}
+
+/******************************************************************************
+ * double seconds_since(struct timespec *)
+ * 
+ * Returns the seconds elapsed on the monotonic clock since the given time.
+ *****************************************************************************/
+double seconds_since(struct timespec * start){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/******************************************************************************
+ * void record_sample(struct shell *, struct job_sample *)
+ * 
+ * Adds a finished job to the session stats.
+ *****************************************************************************/
+void record_sample(struct shell * sh, struct job_sample * sample){
+	struct job_stats * stats = &sh->stats;
+	if(stats->count == stats->capacity){
+		int capacity = stats->capacity ? 2 * stats->capacity : 64;
+		struct job_sample * grown = realloc(stats->samples, capacity * sizeof(struct job_sample));
+		if(grown == NULL)
+			return;
+		stats->samples = grown;
+		stats->capacity = capacity;
+	}
+	stats->samples[stats->count++] = *sample;
+}
+
+/******************************************************************************
+ * void report_time(struct job_sample *)
+ * 
+ * Prints what a timed job used to stderr.
+ *****************************************************************************/
+void report_time(struct job_sample * sample){
+	// keep the report after anything the job printed through us
+	fflush(stdout);
+	fprintf(stderr, "real %.3fs user %.3fs sys %.3fs maxrss %ldKB ctxsw %ld\n",
+		sample->wall, sample->user, sample->sys, sample->max_rss, sample->switches);
+}
+
+/******************************************************************************
+ * unsigned int pid_hash(pid_t, int)
+ * 
+ * Hashes a pid into an index of the given power of two capacity.
+ *****************************************************************************/
+unsigned int pid_hash(pid_t pid, int capacity){
+	return ((unsigned int)pid * 2654435761u) & (unsigned int)(capacity - 1);
+}
+
+/******************************************************************************
+ * void pid_index_insert(struct job_table *, pid_t, int)
+ * 
+ * Adds a pid to the index with linear probing. The index is kept at most half
+ * full so probes stay short.
+ *****************************************************************************/
+void pid_index_insert(struct job_table * jobs, pid_t pid, int slot){
+	if(2 * (jobs->index_used + 1) > jobs->index_capacity)
+		pid_index_resize(jobs, 2 * jobs->index_capacity);
+	unsigned int i = pid_hash(pid, jobs->index_capacity);
+	while(jobs->index[i].pid != 0)
+		i = (i + 1) & (jobs->index_capacity - 1);
+	jobs->index[i].pid = pid;
+	jobs->index[i].job = slot;
+	jobs->index_used++;
+}
+
+/******************************************************************************
+ * int pid_index_find(struct job_table *, pid_t)
+ * 
+ * Returns the position of the pid in the index, or -1 if it isn't there.
+ *****************************************************************************/
+int pid_index_find(struct job_table * jobs, pid_t pid){
+	unsigned int i = pid_hash(pid, jobs->index_capacity);
+	while(jobs->index[i].pid != 0){
+		if(jobs->index[i].pid == pid)
+			return i;
+		i = (i + 1) & (jobs->index_capacity - 1);
+	}
+	return -1;
+}
+
+/******************************************************************************
+ * void pid_index_remove(struct job_table *, int)
+ * 
+ * Removes the entry at the position. The entries after it in the probe run
+ * are shifted back into the hole, so the index never needs tombstones.
+ *****************************************************************************/
+void pid_index_remove(struct job_table * jobs, int pos){
+	unsigned int mask = jobs->index_capacity - 1;
+	unsigned int hole = pos;
+	unsigned int i = pos;
+	jobs->index[hole].pid = 0;
+	jobs->index_used--;
+	while(1){
+		i = (i + 1) & mask;
+		if(jobs->index[i].pid == 0)
+			break;
+		unsigned int home = pid_hash(jobs->index[i].pid, jobs->index_capacity);
+		// leave the entry alone if its home is cyclically in (hole, i]
+		if(hole <= i ? (hole < home && home <= i) : (hole < home || home <= i))
+			continue;
+		jobs->index[hole] = jobs->index[i];
+		jobs->index[i].pid = 0;
+		hole = i;
+	}
+}
+
+/******************************************************************************
+ * void pid_index_resize(struct job_table *, int)
+ * 
+ * Rebuilds the index with the given power of two capacity.
+ *****************************************************************************/
+void pid_index_resize(struct job_table * jobs, int capacity){
+	struct pid_slot * old = jobs->index;
+	int old_capacity = jobs->index_capacity;
+	int i = 0;
+	jobs->index = calloc(capacity, sizeof(struct pid_slot));
+	if(jobs->index == NULL){
+		fprintf(stderr, "smallsh: out of memory\n");
+		exit(1);
+	}
+	jobs->index_capacity = capacity;
+	jobs->index_used = 0;
+	for(; i < old_capacity; i++){
+		if(old[i].pid != 0)
+			pid_index_insert(jobs, old[i].pid, old[i].job);
+	}
+	free(old);
+}
+
+/******************************************************************************
+ * void exec_child(struct shell *, struct stage *)
+ * 
+ * Runs in the child after a fork. Joins the job's process group, sets up the
+ * signal handling, wires up the pipes and the input and output redirects,
+ * then execs the command, or runs it if it is built in. Never returns.
+ *****************************************************************************/
+void exec_child(struct shell * sh, struct stage * st){
+	struct command * cmd = st->cmd;
+	struct sigaction act = sh->act;
+	// intialize file desciptor, redirect, and execution result number
+	int fd;
+	struct redirect * redirect;
+	int exec_result;
+	// the events buffered so far are the shell's to write
+	sh->events.buffer.length = 0;
+	if(st->new_group){
+		// join the job's group before anything else, the parent does this
+		// too so it doesn't matter which of us wins
+		setpgid(0, st->pgid);
+		if(st->take_terminal)
+			tcsetpgrp(0, getpgrp());
+	}
+	// SIGCHLD is only blocked in the shell and the job control signals only
+	// ignored by it
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+	act.sa_handler = SIG_DFL;
+	act.sa_flags = 0;
+	sigaction(SIGTTOU, &act, NULL);
+	sigaction(SIGTTIN, &act, NULL);
+	sigaction(SIGTSTP, &act, NULL);
+	if(st->fg){
+		// if we are in the foreground, we want to be able to be interrupted
+		sigaction(SIGINT, &act, NULL);
+	}
+	// connect the pipes to the neighbouring stages
+	if(st->in_fd >= 0 && dup2(st->in_fd, 0) < 0){
+		fprintf(stderr, "Error redirecting the input\n");
+		exit(1);
+	}
+	if(st->out_fd >= 0 && dup2(st->out_fd, 1) < 0){
+		fprintf(stderr, "Error redirecting the output\n");
+		exit(1);
+	}
+	// a captured job writes everything the pipeline doesn't to the capture
+	if(st->capture_fd >= 0 && ((st->out_fd < 0 && dup2(st->capture_fd, 1) < 0) || dup2(st->capture_fd, 2) < 0)){
+		fprintf(stderr, "Error redirecting the output\n");
+		exit(1);
+	}
+	if(!reads_input(cmd) && !st->fg && st->in_fd < 0){
+		// we are the first stage of a background job, read from /dev/null
+		fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+		if(fd < 0 || dup2(fd, 0) < 0){
+			fprintf(stderr, "Error redirecting the input\n");
+			exit(1);
+		}
+		close(fd);
+	}
+	// apply the redirects in order, so 2>&1 sees an earlier > FILE
+	for(redirect = cmd->redirects; redirect != NULL; redirect = redirect->next){
+		fd = open_redirect(redirect);
+		if(fd < 0){
+			event_redirect(sh, cmd, redirect, errno);
+			events_flush(&sh->events);
+			exit(1);
+		}
+		if(fd == redirect->fd){
+			// it landed right on the target, which has to survive the exec
+			fcntl(fd, F_SETFD, 0);
+		}
+		else{
+			if(dup2(fd, redirect->fd) < 0){
+				fprintf(stderr, "Error redirecting descriptor %d\n", redirect->fd);
+				exit(1);
+			}
+			if(redirect->type != REDIRECT_DUP)
+				close(fd);
+		}
+	}
+	if(sh->opts.close_fds){
+		// close everything above 2 that wasn't redirected, in the gaps
+		// between the redirected descriptors
+		int * kept = arena_alloc(&sh->arena, (cmd->num_redirects + 1) * sizeof(int));
+		int num_kept = kept_fds(cmd, kept);
+		unsigned int from = 3;
+		int i = 0;
+		for(; i < num_kept; i++){
+			if((unsigned int)kept[i] > from)
+				close_range(from, kept[i] - 1, 0);
+			from = kept[i] + 1;
+		}
+		close_range(from, ~0U, 0);
+	}
+	apply_limits(&sh->limits);
+	if(st->builtin != NULL){
+		// a built in in a pipeline runs here and exits with its code, the
+		// jobs and captures it sees have to be its own
+		become_copy(sh);
+		exec_result = st->builtin->run(sh, cmd->argv);
+		fflush(stdout);
+		_exit(exec_result);
+	}
+	// attemp to exec (since this only happens when we are not using a built in command)
+	// the parent already looked the command up, if the file has gone since
+	// then search the PATH again
+	exec_result = execv(st->path, cmd->argv);
+	if(errno == ENOENT && strchr(cmd->argv[0], '/') == NULL)
+		exec_result = execvp(cmd->argv[0], cmd->argv);
+	// if the exec result is not 0, we had an error, print that
+	if(exec_result){
+		if(errno == E2BIG)
+			fprintf(stderr, "smallsh: %s: %s\n", cmd->argv[0], strerror(E2BIG));
+		else
+			fprintf(stderr,"smallsh did not recognize the command: %s\n", cmd->argv[0]);
+		fflush(stdout);
+		exit(1);
+	}
+}
+
+/******************************************************************************
+ * pid_t spawn_child(struct shell *, struct stage *)
+ * 
+ * Launches the command with posix_spawn instead of fork, so the shell's page
+ * tables are never copied. The redirect files are opened here in the parent
+ * and handed to the child as dup2 file actions after the pipe ends, which
+ * lets us report the same errors as the fork path. The spawn attributes put
+ * the child in the job's process group and reset SIGINT for foreground
+ * children. If the resolved path has disappeared it is looked up again once.
+ * Appends are opened with O_APPEND, so every write lands at the end of the
+ * file no matter how many jobs share it.
+ * Returns the pid of the child, or -1 with the status set to an exit status
+ * of 1 if the child could not start.
+ *****************************************************************************/
+pid_t spawn_child(struct shell * sh, struct stage * st){
+	struct command * cmd = st->cmd;
+	int * status = &sh->status;
+	const char * path = st->path;
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t defaults;
+	sigset_t mask;
+	pid_t pid;
+	short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+	int null_fd = -1;
+	int spawn_result;
+	int * opened = arena_alloc(&sh->arena, (cmd->num_redirects + 1) * sizeof(int));
+	struct redirect * redirect;
+	int max_target = 2;
+	int i = 0;
+	// pick the input the same way the fork path does
+	if(!reads_input(cmd) && !st->fg && st->in_fd < 0){
+		null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	}
+	// the files are close on exec, only the dup2 copies reach the child
+	for(redirect = cmd->redirects; redirect != NULL; redirect = redirect->next, i++){
+		opened[i] = open_redirect(redirect);
+		if(opened[i] < 0){
+			event_redirect(sh, cmd, redirect, errno);
+			close_redirects(cmd, opened, i);
+			if(null_fd >= 0)
+				close(null_fd);
+			*status = W_EXITCODE(1, 0);
+			return -1;
+		}
+	}
+	// the dup2 actions run one after another, so a file we opened on
+	// a descriptor that a later redirect targets would be clobbered before
+	// its turn. Move them all above every target first.
+	for(redirect = cmd->redirects; redirect != NULL; redirect = redirect->next)
+		if(redirect->fd > max_target)
+			max_target = redirect->fd;
+	for(i = 0, redirect = cmd->redirects; redirect != NULL; redirect = redirect->next, i++){
+		if(redirect->type != REDIRECT_DUP && opened[i] <= max_target){
+			int moved = fcntl(opened[i], F_DUPFD_CLOEXEC, max_target + 1);
+			if(moved >= 0){
+				close(opened[i]);
+				opened[i] = moved;
+			}
+		}
+	}
+	// build the file actions for the pipes, then the redirects in order so
+	// that a file wins over a pipe just like in the fork path
+	posix_spawn_file_actions_init(&actions);
+	if(st->in_fd >= 0)
+		posix_spawn_file_actions_adddup2(&actions, st->in_fd, 0);
+	if(st->out_fd >= 0)
+		posix_spawn_file_actions_adddup2(&actions, st->out_fd, 1);
+	if(st->capture_fd >= 0 && st->out_fd < 0)
+		posix_spawn_file_actions_adddup2(&actions, st->capture_fd, 1);
+	if(st->capture_fd >= 0)
+		posix_spawn_file_actions_adddup2(&actions, st->capture_fd, 2);
+	if(null_fd >= 0)
+		posix_spawn_file_actions_adddup2(&actions, null_fd, 0);
+	for(i = 0, redirect = cmd->redirects; redirect != NULL; redirect = redirect->next, i++)
+		posix_spawn_file_actions_adddup2(&actions, opened[i], redirect->fd);
+	if(sh->opts.close_fds){
+		// close what we inherited above 2, the gaps between redirected
+		// descriptors one at a time and everything after them at once.
+		// Our own descriptors are close on exec and go away anyway.
+		int * kept = arena_alloc(&sh->arena, (cmd->num_redirects + 1) * sizeof(int));
+		int num_kept = kept_fds(cmd, kept);
+		int from = 3;
+		int flags;
+		int j;
+		for(i = 0; i < num_kept; i++){
+			for(j = from; j < kept[i]; j++){
+				flags = fcntl(j, F_GETFD);
+				if(flags >= 0 && !(flags & FD_CLOEXEC))
+					posix_spawn_file_actions_addclose(&actions, j);
+			}
+			from = kept[i] + 1;
+		}
+		posix_spawn_file_actions_addclosefrom_np(&actions, from);
+	}
+	// foreground children should be interruptible, so reset SIGINT for them
+	posix_spawnattr_init(&attr);
+	sigemptyset(&defaults);
+	sigaddset(&defaults, SIGTTOU);
+	sigaddset(&defaults, SIGTTIN);
+	sigaddset(&defaults, SIGTSTP);
+	if(st->fg)
+		sigaddset(&defaults, SIGINT);
+	posix_spawnattr_setsigdefault(&attr, &defaults);
+	// the child shouldn't inherit the blocked SIGCHLD
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	if(st->new_group){
+		posix_spawnattr_setpgroup(&attr, st->pgid);
+		flags |= POSIX_SPAWN_SETPGROUP;
+	}
+	posix_spawnattr_setflags(&attr, flags);
+	spawn_result = posix_spawn(&pid, path, &actions, &attr, cmd->argv, environ);
+	if(spawn_result == ENOENT && strchr(cmd->argv[0], '/') == NULL){
+		// the cached path is stale, resolve the command again
+		forget_command(sh, cmd->argv[0]);
+		path = resolve_command(sh, cmd->argv[0]);
+		if(path != NULL)
+			spawn_result = posix_spawn(&pid, path, &actions, &attr, cmd->argv, environ);
+	}
+	// clean up, the child has its own copies of the descriptors now
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	if(null_fd >= 0)
+		close(null_fd);
+	close_redirects(cmd, opened, cmd->num_redirects);
+	if(spawn_result != 0){
+		// the args and environment together can't be more than ARG_MAX
+		if(spawn_result == E2BIG)
+			fprintf(stderr, "smallsh: %s: %s\n", cmd->argv[0], strerror(E2BIG));
+		else
+			fprintf(stderr,"smallsh did not recognize the command: %s\n", cmd->argv[0]);
+		*status = W_EXITCODE(1, 0);
+		return -1;
+	}
+	return pid;
+}
+
+/******************************************************************************
+ * const char * resolve_command(struct shell *, const char *)
+ * 
+ * Returns the file to exec for a command. Names with a slash are used as
+ * they are. Other names are looked up in the command cache, and searched for
+ * on the PATH the first time. The cache is emptied whenever PATH is no longer
+ * what it was resolved with. Returns NULL if the command can't be found.
+ *****************************************************************************/
+const char * resolve_command(struct shell * sh, const char * name){
+	struct path_cache * cache = &sh->commands;
+	struct path_entry * entry;
+	const char * path_var = getenv("PATH");
+	unsigned int bucket;
+	size_t name_length;
+	if(strchr(name, '/') != NULL)
+		return name;
+	if(path_var == NULL)
+		path_var = "/usr/bin:/bin";
+	if(cache->path_var == NULL || strcmp(cache->path_var, path_var) != 0){
+		// PATH changed, nothing we resolved before can be trusted
+		clear_path_cache(cache);
+		cache->path_var = strdup(path_var);
+	}
+	bucket = string_hash(name) & (PATH_CACHE_SIZE - 1);
+	for(entry = cache->buckets[bucket]; entry != NULL; entry = entry->next){
+		if(strcmp(entry->name, name) == 0)
+			return entry->path;
+	}
+	// search each directory of the PATH, an empty one means the current one
+	name_length = strlen(name);
+	const char * dir = path_var;
+	while(1){
+		const char * end = strchrnul(dir, ':');
+		size_t dir_length = end - dir;
+		char candidate[PATH_MAX];
+		struct stat info;
+		if(dir_length == 0){
+			candidate[0] = '.';
+			dir_length = 1;
+		}
+		else if(dir_length + name_length + 2 <= sizeof(candidate)){
+			memcpy(candidate, dir, dir_length);
+		}
+		if(dir_length + name_length + 2 <= sizeof(candidate)){
+			candidate[dir_length] = '/';
+			memcpy(candidate + dir_length + 1, name, name_length + 1);
+			if(stat(candidate, &info) == 0 && S_ISREG(info.st_mode) && access(candidate, X_OK) == 0){
+				// remember it, the name and path share one allocation
+				size_t path_length = dir_length + name_length + 1;
+				entry = malloc(sizeof(struct path_entry) + name_length + 1 + path_length + 1);
+				entry->name = (char *)(entry + 1);
+				entry->path = entry->name + name_length + 1;
+				memcpy(entry->name, name, name_length + 1);
+				memcpy(entry->path, candidate, path_length + 1);
+				entry->next = cache->buckets[bucket];
+				cache->buckets[bucket] = entry;
+				cache->num_entries++;
+				return entry->path;
+			}
+		}
+		if(*end == '\0')
+			break;
+		dir = end + 1;
+	}
+	return NULL;
+}
+
+/******************************************************************************
+ * void forget_command(struct shell *, const char *)
+ * 
+ * Drops a command from the command cache.
+ *****************************************************************************/
+void forget_command(struct shell * sh, const char * name){
+	struct path_cache * cache = &sh->commands;
+	struct path_entry ** link = &cache->buckets[string_hash(name) & (PATH_CACHE_SIZE - 1)];
+	while(*link != NULL){
+		if(strcmp((*link)->name, name) == 0){
+			struct path_entry * stale = *link;
+			*link = stale->next;
+			free(stale);
+			cache->num_entries--;
+			return;
+		}
+		link = &(*link)->next;
+	}
+}
+
+/******************************************************************************
+ * void clear_path_cache(struct path_cache *)
+ * 
+ * Empties the command cache and forgets the PATH it was built for.
+ *****************************************************************************/
+void clear_path_cache(struct path_cache * cache){
+	int i = 0;
+	for(; i < PATH_CACHE_SIZE; i++){
+		struct path_entry * entry = cache->buckets[i];
+		while(entry != NULL){
+			struct path_entry * next = entry->next;
+			free(entry);
+			entry = next;
+		}
+		cache->buckets[i] = NULL;
+	}
+	free(cache->path_var);
+	cache->path_var = NULL;
+	cache->num_entries = 0;
+}
+
+/******************************************************************************
+ * void handle_fork_exec(struct shell *, struct pipeline *)
+ * 
+ * Handles the launch of every stage of the pipeline and then the execution
+ * from there on. All stages are started right away, connected by close on
+ * exec pipes, and put in one process group led by the first stage. The
+ * children are started with either fork or posix_spawn depending on the
+ * engine, built in stages are always forked. Every job goes in the job
+ * table. Will have the parent wait for the children if the job is in the
+ * foreground, the status is the one of the last stage. Will not wait if the
+ * job is in the background. Returns the job table slot of a background job,
+ * or -1 if nothing was left running in the background.
+ *****************************************************************************/
+int handle_fork_exec(struct shell * sh, struct pipeline * pipeline){
+	struct shell_options * opts = &sh->opts;
+	int * status = &sh->status;
+	struct stage st;
+	pid_t pids[pipeline->num_cmds];
+	int fds[2];
+	int next_in = -1;
+	int i = 0;
+	struct timespec started;
+	int num_started = 0;
+	int slot;
+	int capture = -1;
+	char * cgroup = NULL;
+	cpu_set_t spread;
+	cpu_set_t * cpus = pipeline->cpus;
+	// anything we printed has to come out before the children's output
+	fflush(stdout);
+	// the children take over our CPUs and memory policy, so we move to where
+	// the job should run while it starts and come back afterwards
+	if(cpus == NULL && !pipeline->fg && opts->pin != PIN_NONE)
+		cpus = next_placement(sh, &spread);
+	if(cpus != NULL && place_shell(sh, cpus) < 0){
+		fprintf(stderr, "smallsh: pin: %s\n", strerror(errno));
+		*status = W_EXITCODE(1, 0);
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	st.fg = pipeline->fg;
+	st.in_fd = -1;
+	// background jobs always get their own group, foreground jobs only when
+	// we can hand them the terminal so that ^C still reaches them
+	st.new_group = !pipeline->fg || opts->terminal;
+	st.pgid = 0;
+	st.take_terminal = pipeline->fg && opts->terminal;
+	st.capture_fd = -1;
+	st.cgroup_fd = -1;
+	// capped jobs get a cgroup of their own, and don't run without it
+	if(sh->limits.cpus > 0 || sh->limits.memory > 0){
+		cgroup = job_cgroup(sh, &st.cgroup_fd);
+		if(cgroup == NULL){
+			if(cpus != NULL)
+				place_shell(sh, NULL);
+			*status = W_EXITCODE(1, 0);
+			return -1;
+		}
+	}
+	// background jobs write to a pipe of their own when we capture them
+	if(!pipeline->fg && pipeline->batch_index < 0 && opts->capture_size > 0)
+		capture = capture_open(&sh->captures, &st.capture_fd);
+	for(; i < pipeline->num_cmds; i++){
+		st.cmd = &pipeline->cmds[i];
+		st.builtin = find_builtin(sh, st.cmd->argv[0]);
+		st.path = NULL;
+		st.out_fd = -1;
+		if(i < pipeline->num_cmds - 1){
+			// connect this stage to the next one
+			if(pipe2(fds, O_CLOEXEC) < 0){
+				fprintf(stderr, "error creating a pipe\n");
+				*status = 1;
+				exit_shell(sh);
+			}
+			if(opts->pipe_size > 0)
+				fcntl(fds[1], F_SETPIPE_SZ, opts->pipe_size);
+			st.out_fd = fds[1];
+			next_in = fds[0];
+		}
+		if(st.builtin == NULL)
+			st.path = resolve_command(sh, st.cmd->argv[0]);
+		// a forked child can't tell us that its cached path has gone and
+		// posix_spawn can, so only a child we fork needs it checked first
+		if(st.path != NULL && !(opts->engine == ENGINE_SPAWN && !sh->limits.any && st.cgroup_fd < 0) &&
+				strchr(st.cmd->argv[0], '/') == NULL && access(st.path, X_OK) < 0){
+			forget_command(sh, st.cmd->argv[0]);
+			st.path = resolve_command(sh, st.cmd->argv[0]);
+		}
+		if(st.builtin == NULL && st.path == NULL){
+			// there is nothing to run
+			fprintf(stderr,"smallsh did not recognize the command: %s\n", st.cmd->argv[0]);
+			*status = W_EXITCODE(1, 0);
+			pids[i] = -1;
+		}
+		else if(opts->engine == ENGINE_SPAWN && st.builtin == NULL && !sh->limits.any && st.cgroup_fd < 0){
+			// spawn the child, if it could not start the status is already set
+			pids[i] = spawn_child(sh, &st);
+		}
+		else{
+			// fork the parent and the child processes, limits are set in
+			// the child so they are always forked
+			pids[i] = fork_into(st.cgroup_fd);
+			if(pids[i] == 0){
+				// this is the child
+				exec_child(sh, &st);
+			}
+			else if (pids[i] < 0){// if the pid is negative
+				// whoops, forking error
+				// exit shell
+				fprintf(stderr, "error in fork\n");
+				*status = 1;
+				exit_shell(sh);
+			}
+		}
+		if(pids[i] > 0)
+			num_started++;
+		if(pids[i] > 0 && st.new_group){
+			// the first stage that started leads the group
+			if(st.pgid == 0){
+				st.pgid = pids[i];
+				if(st.take_terminal)
+					tcsetpgrp(0, st.pgid);
+			}
+			setpgid(pids[i], st.pgid);
+		}
+		// the children hold their own copies of the pipe ends now
+		if(st.in_fd >= 0)
+			close(st.in_fd);
+		if(st.out_fd >= 0)
+			close(st.out_fd);
+		st.in_fd = next_in;
+		next_in = -1;
+	}
+	// we are the parent, only the children write to the capture pipe
+	if(cpus != NULL)
+		place_shell(sh, NULL);
+	if(st.capture_fd >= 0)
+		close(st.capture_fd);
+	if(capture >= 0 && num_started == 0)
+		capture_remove(&sh->captures, capture);
+	if(st.cgroup_fd >= 0)
+		close(st.cgroup_fd);
+	if(cgroup != NULL && num_started == 0){
+		rmdir(cgroup);
+		free(cgroup);
+	}
+	if(num_started == 0)
+		return -1;
+	// add the job to the table, its clock started with the first stage
+	slot = job_add(&sh->jobs, pids, pipeline->num_cmds, st.pgid, pipeline->batch_index);
+	sh->jobs.jobs[slot].started = started;
+	sh->jobs.jobs[slot].timed = pipeline->timed;
+	if(capture >= 0)
+		sh->captures.captures[capture].pid = sh->jobs.jobs[slot].pids[0];
+	sh->jobs.jobs[slot].cgroup = cgroup;
+	event_spawn(sh, slot, pipeline);
+	// if we are in the fg wait until the job is done or stopped
+	if(pipeline->fg){
+		wait_job(sh, slot, st.take_terminal);
+		return -1;
+	}
+	for(i = 0; i < pipeline->num_cmds; i++){
+		if(pids[i] <= 0 || pipeline->batch_index >= 0)
+			continue;
+		// print the background process id
+		printf("Background process id number %d\n", pids[i]);
+	}
+	return slot;
+}
+
+/******************************************************************************
+ * void wait_job(struct shell *, int, int)
+ * 
+ * Waits for a job in the foreground, until all of its processes are done or
+ * it is stopped. A stopped job stays in the job table for fg and bg. Only
+ * jobs with their own process group can be stopped, the others could never
+ * be continued as a whole. Takes the terminal back afterwards if the job was
+ * given it. Once the job is done the shell's status is the job's status.
+ *****************************************************************************/
+void wait_job(struct shell * sh, int slot, int take_terminal){
+	struct job_table * jobs = &sh->jobs;
+	struct job * job = &jobs->jobs[slot];
+	int options = job->pgid != 0 ? WUNTRACED : 0;
+	struct rusage usage;
+	int child_status;
+	int signalled = 0;
+	int result;
+	int i = 0;
+	// wait for the processes that haven't been reaped, in pipeline order
+	while(job->in_use && i < job->num_pids){
+		pid_t pid = job->pids[i];
+		if(pid_index_find(jobs, pid) < 0){
+			i++;
+			continue;
+		}
+		// while captured jobs are running keep reading their output, they
+		// would block once their pipe is full
+		if(sh->captures.num_open > 0){
+			result = wait4(pid, &child_status, options | WNOHANG, &usage);
+			if(result == 0){
+				signalled |= wait_for_output(sh);
+				continue;
+			}
+		}
+		else{
+			result = wait4(pid, &child_status, options, &usage);
+		}
+		if(result < 0){
+			if(errno == EINTR)
+				continue;
+			// somebody else reaped it, don't wait forever
+			job_reaped(jobs, pid, 0, NULL);
+			continue;
+		}
+		if(WIFSTOPPED(child_status)){
+			job->stopped = 1;
+			jobs->current = slot;
+			printf("\nJob %d stopped by signal %d\n", slot + 1, WSTOPSIG(child_status));
+			break;
+		}
+		job_reaped(jobs, pid, child_status, &usage);
+	}
+	// take the terminal back from the job
+	if(take_terminal)
+		tcsetpgrp(0, getpgrp());
+	// we took SIGCHLD off the signalfd, so reap the others ourselves
+	if(signalled)
+		wait_for_children(sh);
+	if(job->in_use)
+		return;
+	sh->status = job->status;
+	job->usage.wall = seconds_since(&job->started);
+	record_sample(sh, &job->usage);
+	event_done(sh, slot);
+	if(job->timed)
+		report_time(&job->usage);
+	if(!WIFEXITED(sh->status))
+		printf("The process was terminated by a signal %d\n", sh->status);
+}
+
+/******************************************************************************
+ * void load_options(struct shell_options *)
+ * 
+ * Reads the shell settings from the environment. SMALLSH_ENGINE picks the
+ * launch engine, defaulting to posix_spawn and falling back to it on unknown
+ * values. SMALLSH_PIPE_SIZE asks for larger pipes between pipeline stages.
+ * SMALLSH_HISTFILE and SMALLSH_HISTSIZE say where the history goes and how
+ * much of it is kept. SMALLSH_CLOSE_FDS turns on closing inherited
+ * descriptors in children. SMALLSH_EVENTS opens the event log.
+ *****************************************************************************/
+void load_options(struct shell_options * opts){
+	char * name = getenv("SMALLSH_ENGINE");
+	char * pipe_size = getenv("SMALLSH_PIPE_SIZE");
+	opts->engine = ENGINE_SPAWN;
+	if(name != NULL && strcmp(name, "fork") == 0){
+		opts->engine = ENGINE_FORK;
+	}
+	else if(name != NULL && strcmp(name, "spawn") != 0){
+		fprintf(stderr, "smallsh: unknown engine %s, using spawn\n", name);
+	}
+	opts->pipe_size = pipe_size != NULL ? atoi(pipe_size) : 0;
+	char * close_fds = getenv("SMALLSH_CLOSE_FDS");
+	opts->close_fds = close_fds != NULL && atoi(close_fds) > 0;
+	// we only do terminal handoff when we are the terminal's foreground group
+	opts->terminal = isatty(0) && tcgetpgrp(0) == getpgrp();
+	char * history_file = getenv("SMALLSH_HISTFILE");
+	char * history_size = getenv("SMALLSH_HISTSIZE");
+	char * home = getenv("HOME");
+	opts->history_file = NULL;
+	if(history_file != NULL){
+		// an empty name turns the file off
+		if(*history_file != '\0')
+			opts->history_file = strdup(history_file);
+	}
+	else if(home != NULL){
+		opts->history_file = malloc(strlen(home) + sizeof("/.smallsh_history"));
+		strcpy(opts->history_file, home);
+		strcat(opts->history_file, "/.smallsh_history");
+	}
+	opts->history_size = history_size != NULL ? atoi(history_size) : HISTORY_SIZE;
+	if(opts->history_size < 1)
+		opts->history_size = HISTORY_SIZE;
+	char * workers = getenv("SMALLSH_WORKERS");
+	opts->workers = workers != NULL ? atoi(workers) : sysconf(_SC_NPROCESSORS_ONLN);
+	if(opts->workers < 1)
+		opts->workers = 1;
+	char * capture_size = getenv("SMALLSH_CAPTURE");
+	opts->capture_size = capture_size != NULL && atol(capture_size) > 0 ? atol(capture_size) : 0;
+	char * cgroup_root = getenv("SMALLSH_CGROUP");
+	opts->cgroup_root = cgroup_root != NULL && *cgroup_root != '\0' ? strdup(cgroup_root) : NULL;
+	char * pin = getenv("SMALLSH_PIN");
+	opts->pin = PIN_NONE;
+	if(pin != NULL && strcmp(pin, "cpu") == 0)
+		opts->pin = PIN_CPU;
+	else if(pin != NULL && strcmp(pin, "node") == 0)
+		opts->pin = PIN_NODE;
+	else if(pin != NULL && *pin != '\0')
+		fprintf(stderr, "smallsh: unknown SMALLSH_PIN %s, not pinning\n", pin);
+	char * shutdown = getenv("SMALLSH_SHUTDOWN");
+	opts->shutdown = shutdown != NULL ? atof(shutdown) : SHUTDOWN_GRACE;
+	char * events = getenv("SMALLSH_EVENTS");
+	char * end;
+	opts->event_fd = -1;
+	if(events != NULL && *events != '\0'){
+		// a number is a descriptor someone opened for us, anything else a file
+		opts->event_fd = strtol(events, &end, 10);
+		if(*end != '\0')
+			opts->event_fd = open(events, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		else if(fcntl(opts->event_fd, F_SETFD, FD_CLOEXEC) < 0)
+			opts->event_fd = -1;
+		if(opts->event_fd < 0)
+			fprintf(stderr, "smallsh: cannot write events to %s: %s\n", events, strerror(errno));
+		opts->event_fd = shell_fd(opts->event_fd);
+	}
+}
+
+/******************************************************************************
+ * void exit_shell(struct shell *)
+ * 
+ * Exits the shell. Cleans up unfinished processes first: every job that is
+ * left gets SIGTERM and SMALLSH_SHUTDOWN seconds to exit, while we reap them
+ * off the signalfd as usual. The ones still there after that are killed and
+ * reported. A grace of 0 kills them right away.
+ *****************************************************************************/
+void exit_shell(struct shell * sh){
+	struct job_table * jobs = &sh->jobs;
+	struct pollfd fds[2] = { { 0 } };
+	struct timespec started;
+	double grace = sh->opts.shutdown;
+	int status = sh->status;
+	int remaining;
+	// wait for unfinished children
+	wait_for_children(sh);
+	int i = 0;
+	if(jobs->num_jobs > 0 && grace > 0){
+		// ask every job to finish, a stopped one has to run to hear it
+		for(; i < jobs->capacity; i++){
+			if(!jobs->jobs[i].in_use)
+				continue;
+			signal_job(&jobs->jobs[i], SIGTERM);
+			signal_job(&jobs->jobs[i], SIGCONT);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &started);
+		while(jobs->num_jobs > 0){
+			remaining = (grace - seconds_since(&started)) * 1000;
+			if(remaining <= 0)
+				break;
+			// keep reading captured output, a job blocked on it can't exit
+			fds[0].fd = sh->signal_fd;
+			fds[0].events = POLLIN;
+			fds[1].fd = sh->captures.epoll_fd;
+			fds[1].events = POLLIN;
+			if(poll(fds, sh->captures.num_open > 0 ? 2 : 1, remaining) < 0 && errno != EINTR)
+				break;
+			if(fds[1].revents & POLLIN)
+				drain_captures(&sh->captures);
+			if(drain_signals(sh->signal_fd))
+				wait_for_children(sh);
+		}
+	}
+	// exit shell, killing the group of every job that is still running
+	for(i = 0; i < jobs->capacity; i++){
+		if(!jobs->jobs[i].in_use)
+			continue;
+		// a job in a cgroup can be killed with whatever it left behind
+		if(jobs->jobs[i].cgroup != NULL)
+			cgroup_write(jobs->jobs[i].cgroup, "cgroup.kill", "1");
+		signal_job(&jobs->jobs[i], SIGKILL);
+		fprintf(stderr, "smallsh: killed job %d:", i + 1);
+		int j = 0;
+		for(; j < jobs->jobs[i].num_pids; j++)
+			fprintf(stderr, " %d", jobs->jobs[i].pids[j]);
+		fprintf(stderr, "\n");
+		if(event_begin(&sh->events, "kill")){
+			event_printf(&sh->events, ",\"job\":%d,\"pgid\":%d,\"pids\":[", i + 1, jobs->jobs[i].pgid);
+			for(j = 0; j < jobs->jobs[i].num_pids; j++)
+				event_printf(&sh->events, j > 0 ? ",%d" : "%d", jobs->jobs[i].pids[j]);
+			event_printf(&sh->events, "]");
+			event_end(&sh->events);
+		}
+	}
+	events_flush(&sh->events);
+	// make sure that we don't leak memory
+	job_table_free(jobs);
+	clear_path_cache(&sh->commands);
+	free(sh->stats.samples);
+	if(sh->has_history)
+		history_free(&sh->history);
+	free(sh->opts.history_file);
+	free(sh->opts.cgroup_root);
+	free(sh->placement.node_cpus);
+	free(sh->placement.node_ids);
+	for(i = 0; i < DIR_CACHE_SIZE; i++)
+		dir_listing_free(&sh->dirs.listings[i]);
+	for(i = 0; i < DEFINITION_TABLE_SIZE; i++){
+		struct definition * def = sh->definitions.buckets[i];
+		while(def != NULL){
+			struct definition * next = def->next;
+			definition_free(def);
+			def = next;
+		}
+	}
+	free(sh->expanded.data);
+	free(sh->events.buffer.data);
+	capture_free(&sh->captures);
+	arena_free(&sh->arena);
+	reader_free(&sh->reader);
+	// the jobs reaped on the way out don't change how we exit
+	exit(status);
+}
+
+/******************************************************************************
+ * void signal_job(struct job *, int)
+ * 
+ * Sends the signal to the job's process group, or to each of its processes
+ * when it doesn't have a group of its own.
+ *****************************************************************************/
+void signal_job(struct job * job, int sig){
+	int i = 0;
+	if(job->pgid != 0){
+		kill(-job->pgid, sig);
+		return;
+	}
+	for(; i < job->num_pids; i++)
+		kill(job->pids[i], sig);
+}
+
+/******************************************************************************
+ * char * prompt(struct shell *)
+ * 
+ * Prompts the user and returns the next line of input. While we wait for the
+ * line we also watch the signalfd, so background jobs that finish are reaped
+ * and reported right away instead of after the next command. At the end of
+ * the input the shell exits the way exit does.
+ *****************************************************************************/
+char * prompt(struct shell * sh){
+	struct line_reader * reader = &sh->reader;
+	struct job_table * jobs = &sh->jobs;
+	int signal_fd = sh->signal_fd;
+	struct pollfd fds[3] = { { 0 } };
+	char * line;
+	ssize_t num_read;
+	int num_fds;
+	// report the jobs that finished while the last command ran, without
+	// touching the signalfd at all when there are none
+	if(jobs->num_jobs > 0 && drain_signals(signal_fd))
+		wait_for_children(sh);
+	if(reader->interactive){
+		// print the prompt
+		printf(": ");
+	}
+	// get the input from the user
+	while((line = next_line(reader)) == NULL){
+		// the events, the prompt and the reports wait no longer than we
+		// are about to, but a line that is already read goes on without
+		// a write
+		events_flush(&sh->events);
+		fflush(stdout);
+		// a mapped script has nothing left to read
+		if(reader->mapped)
+			exit_shell(sh);
+		fds[0].fd = reader->fd;
+		fds[0].events = POLLIN;
+		// only watch for children when there are jobs that could finish,
+		// and for output when some is still being captured
+		fds[1].fd = jobs->num_jobs > 0 ? signal_fd : -1;
+		fds[1].events = POLLIN;
+		fds[2].fd = sh->captures.epoll_fd;
+		fds[2].events = POLLIN;
+		num_fds = sh->captures.num_open > 0 ? 3 : jobs->num_jobs > 0 ? 2 : 1;
+		if(poll(fds, num_fds, -1) < 0){
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "smallsh: poll failed\n");
+			exit(1);
+		}
+		if(fds[2].revents & POLLIN)
+			drain_captures(&sh->captures);
+		if(jobs->num_jobs > 0 && (fds[1].revents & POLLIN) && drain_signals(signal_fd)){
+			// a child changed state while we were idle, prompt again if we
+			// printed anything about it
+			if(wait_for_children(sh) && reader->interactive){
+				printf(": ");
+			}
+		}
+		if(fds[0].revents == 0)
+			continue;
+		num_read = reader_fill(reader);
+		if(num_read < 0 && errno == EINTR)
+			continue;
+		if(num_read <= 0){
+			// in the case that we reached the end of an input file, run
+			// whatever is left without a newline before exiting
+			if((line = reader_rest(reader)) != NULL)
+				return line;
+			// the jobs get the same shutdown as after exit
+			exit_shell(sh);
+		}
+	}
+	return line;
+}
+
+/******************************************************************************
+ * char * next_line(struct line_reader *)
+ * 
+ * Returns the next buffered line with its newline replaced by a null, or NULL
+ * if no whole line is buffered yet. A mapped script is all there, so its last
+ * line is returned even without a newline.
+ *****************************************************************************/
+char * next_line(struct line_reader * reader){
+	char * line = reader->buf + reader->start;
+	size_t length = reader->end - reader->start;
+	char * newline = memchr(line, '\n', length);
+	if(newline != NULL){
+		*newline = '\0';
+		reader->start += newline - line + 1;
+		reader->lines++;
+		return line;
+	}
+	if(reader->mapped && length > 0){
+		reader->start = reader->end;
+		reader->lines++;
+		if(reader->end % sysconf(_SC_PAGESIZE) != 0){
+			// the rest of the last page is ours and already zeroed
+			line[length] = '\0';
+			return line;
+		}
+		// the file ends on a page boundary, so copy the line out
+		reader->tail = malloc(length + 1);
+		memcpy(reader->tail, line, length);
+		reader->tail[length] = '\0';
+		return reader->tail;
+	}
+	return NULL;
+}
+
+/******************************************************************************
+ * void reader_init(struct line_reader *, int, int)
+ * 
+ * Sets up a reader on the descriptor. Scripts in regular files are mapped
+ * privately and writably, so lines can be terminated in place without ever
+ * touching the file. Everything else gets a buffer, which grows as needed
+ * to hold the longest line.
+ *****************************************************************************/
+void reader_init(struct line_reader * reader, int fd, int interactive){
+	struct stat info;
+	reader->fd = fd;
+	reader->start = 0;
+	reader->end = 0;
+	reader->mapped = 0;
+	reader->interactive = interactive;
+	reader->tail = NULL;
+	reader->receives_fds = 0;
+	reader->passed[0] = reader->passed[1] = reader->passed[2] = -1;
+	reader->lines = 0;
+	if(!interactive && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0){
+		reader->buf = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if(reader->buf != MAP_FAILED){
+			madvise(reader->buf, info.st_size, MADV_SEQUENTIAL);
+			reader->mapped = 1;
+			reader->size = info.st_size;
+			reader->end = info.st_size;
+			return;
+		}
+	}
+	reader->size = interactive ? LINE_CHUNK : SCRIPT_CHUNK;
+	reader->buf = malloc(reader->size + 1);
+}
+
+/******************************************************************************
+ * void reader_free(struct line_reader *)
+ * 
+ * Unmaps or frees the reader's buffer.
+ *****************************************************************************/
+void reader_free(struct line_reader * reader){
+	int i = 0;
+	for(; i < 3; i++){
+		if(reader->passed[i] >= 0)
+			close(reader->passed[i]);
+		reader->passed[i] = -1;
+	}
+	if(reader->mapped)
+		munmap(reader->buf, reader->size);
+	else
+		free(reader->buf);
+	free(reader->tail);
+	reader->buf = NULL;
+	reader->tail = NULL;
+}
+
+/******************************************************************************
+ * ssize_t reader_fill(struct line_reader *)
+ * 
+ * Reads more input into the buffer, first moving the unread bytes to the
+ * front. A line that doesn't fit doubles the buffer. Returns what read
+ * returned.
+ *****************************************************************************/
+ssize_t reader_fill(struct line_reader * reader){
+	ssize_t num_read;
+	// make room for more input at the end of the buffer
+	if(reader->start > 0){
+		memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+		reader->end -= reader->start;
+		reader->start = 0;
+	}
+	if(reader->end == reader->size){
+		char * bigger = realloc(reader->buf, 2 * reader->size + 1);
+		if(bigger == NULL){
+			fprintf(stderr, "smallsh: out of memory\n");
+			exit(1);
+		}
+		reader->buf = bigger;
+		reader->size *= 2;
+	}
+	if(reader->receives_fds)
+		num_read = receive_input(reader, reader->buf + reader->end, reader->size - reader->end);
+	else
+		num_read = read(reader->fd, reader->buf + reader->end, reader->size - reader->end);
+	if(num_read > 0)
+		reader->end += num_read;
+	return num_read;
+}
+
+/******************************************************************************
+ * char * reader_rest(struct line_reader *)
+ * 
+ * At the end of the input, returns the last line if it had no newline, or
+ * NULL if there is nothing left.
+ *****************************************************************************/
+char * reader_rest(struct line_reader * reader){
+	char * line = reader->buf + reader->start;
+	if(reader->end == reader->start)
+		return NULL;
+	reader->buf[reader->end] = '\0';
+	reader->start = reader->end;
+	reader->lines++;
+	return line;
+}
+
+/******************************************************************************
+ * char * reader_next(struct line_reader *)
+ * 
+ * Returns the next line, blocking until it has been read. Returns NULL at
+ * the end of the input.
+ *****************************************************************************/
+char * reader_next(struct line_reader * reader){
+	char * line;
+	ssize_t num_read;
+	while((line = next_line(reader)) == NULL){
+		if(reader->mapped)
+			return NULL;
+		num_read = reader_fill(reader);
+		if(num_read < 0 && errno == EINTR)
+			continue;
+		if(num_read <= 0)
+			return reader_rest(reader);
+	}
+	return line;
+}
+
+/******************************************************************************
+ * ssize_t receive_input(struct line_reader *, char *, size_t)
+ * 
+ * Reads from a client connection like read does, also picking up the stdin,
+ * stdout and stderr the client may have sent along with its input. They are
+ * kept for the next line, replacing any that weren't used yet.
+ *****************************************************************************/
+ssize_t receive_input(struct line_reader * reader, char * buf, size_t length){
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	struct iovec iov = { buf, length };
+	struct msghdr msg = { 0 };
+	struct cmsghdr * cmsg;
+	ssize_t num_read;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	num_read = recvmsg(reader->fd, &msg, MSG_CMSG_CLOEXEC);
+	for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int * fds = (int *)CMSG_DATA(cmsg);
+		int i = 0;
+		for(; i < 3; i++){
+			if(reader->passed[i] >= 0)
+				close(reader->passed[i]);
+			reader->passed[i] = i < count ? fds[i] : -1;
+		}
+		// more than we have use for
+		for(; i < count; i++)
+			close(fds[i]);
+	}
+	return num_read;
+}
+
+/******************************************************************************
+ * void take_passed(struct line_reader *, int *)
+ * 
+ * Hands over the descriptors that came with the line just read, -1 for the
+ * ones the client didn't send, so the next line starts without any.
+ *****************************************************************************/
+void take_passed(struct line_reader * reader, int * fds){
+	int i = 0;
+	for(; i < 3; i++){
+		fds[i] = reader->passed[i];
+		reader->passed[i] = -1;
+	}
+}
+
+/******************************************************************************
+ * int setup_reaper()
+ * 
+ * Blocks SIGCHLD and returns a non blocking signalfd that becomes readable
+ * whenever a child exits.
+ *****************************************************************************/
+int setup_reaper(){
+	sigset_t mask;
+	int fd;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if(fd < 0){
+		fprintf(stderr, "smallsh: could not create the signalfd\n");
+		exit(1);
+	}
+	return shell_fd(fd);
+}
+
+/******************************************************************************
+ * int shell_fd(int)
+ * 
+ * Moves a descriptor the shell keeps open to SHELL_FDS or above, close on
+ * exec, so a built in's redirect like 3>file can't land on it. Returns the
+ * new descriptor, or the old one if it is already there or can't be moved.
+ *****************************************************************************/
+int shell_fd(int fd){
+	int moved;
+	if(fd < 0 || fd >= SHELL_FDS)
+		return fd;
+	moved = fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FDS);
+	if(moved < 0)
+		return fd;
+	close(fd);
+	return moved;
+}
+
+/******************************************************************************
+ * int drain_signals(int)
+ * 
+ * Reads every pending SIGCHLD off the signalfd. Returns 1 if there was at
+ * least one, in which case the caller should reap. Signals of the same kind
+ * are merged, so one of them can stand for several children.
+ *****************************************************************************/
+int drain_signals(int signal_fd){
+	struct signalfd_siginfo info[16];
+	int got_signal = 0;
+	while(read(signal_fd, info, sizeof(info)) > 0)
+		got_signal = 1;
+	return got_signal;
+}
+
+/******************************************************************************
+ * void get_status(int*)
+ * 
+ * gets the status of the shell using the status pointer, the WIFEXITED and 
+ * WEXITSTATUS macros. If the process exited normally, we print the exit 
+ * status. Else, the process was killed by a signal and we print the signal.
+ *****************************************************************************/
+void get_status(int *status){
+	// if the status indicates that the process exited
+	if(WIFEXITED(*status)){
+		// let the user know that this is the case
+		int exitstatus = WEXITSTATUS(*status);
+		printf("The proccess' exit status was %d\n", exitstatus);
+	}
+	else{// the process was killed by a signal
+		printf("The process was terminated by a signal %d\n", *status);
+	}
+	
+}
+
+/******************************************************************************
+ * void run_command(struct shell *, struct pipeline *)
+ * 
+ * Runs a parsed command line. A lone built in command runs in the shell
+ * unless it has an &, everything else is handed to handle_fork_exec.
+ *****************************************************************************/
+void run_command(struct shell * sh, struct pipeline * pipeline){
+	struct builtin * builtin;
+	if(pipeline->num_cmds == 0){
+		// blank lines and comments don't do anything
+		return;
+	}
+	// a built in put in the background is forked like a pipeline stage
+	builtin = pipeline->num_cmds == 1 && pipeline->fg ? find_builtin(sh, pipeline->cmds[0].argv[0]) : NULL;
+	if(builtin != NULL && pipeline->timed){
+		// time a built in by what the shell itself used while it ran
+		struct job_sample usage;
+		struct rusage before;
+		struct rusage after;
+		struct timespec started;
+		clock_gettime(CLOCK_MONOTONIC, &started);
+		getrusage(RUSAGE_SELF, &before);
+		run_builtin(sh, builtin, &pipeline->cmds[0]);
+		getrusage(RUSAGE_SELF, &after);
+		memset(&usage, 0, sizeof(usage));
+		usage.wall = seconds_since(&started);
+		usage.user = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) + (after.ru_utime.tv_usec - before.ru_utime.tv_usec) / 1e6;
+		usage.sys = (after.ru_stime.tv_sec - before.ru_stime.tv_sec) + (after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1e6;
+		usage.max_rss = after.ru_maxrss;
+		usage.switches = (after.ru_nvcsw + after.ru_nivcsw) - (before.ru_nvcsw + before.ru_nivcsw);
+		report_time(&usage);
+	}
+	else if(builtin != NULL){
+		run_builtin(sh, builtin, &pipeline->cmds[0]);
+	}
+	else{
+		// the user passed in a command that is not built in, handle it.
+		handle_fork_exec(sh, pipeline);
+	}
+}
+
+// The built in commands
+struct builtin builtins[] = {
+	{ "cd", builtin_cd, 1 },
+	{ "status", builtin_status, 0 },
+	{ "exit", builtin_exit, 0 },
+	{ "echo", builtin_echo, 1 },
+	{ "true", builtin_true, 1 },
+	{ "false", builtin_false, 1 },
+	{ "pwd", builtin_pwd, 1 },
+	{ "export", builtin_export, 1 },
+	{ "unset", builtin_unset, 1 },
+	{ "test", builtin_test, 1 },
+	{ "[", builtin_test, 1 },
+	{ "hash", builtin_hash, 1 },
+	{ "parallel", builtin_parallel, 1 },
+	{ "jobs", builtin_jobs, 1 },
+	{ "wait", builtin_wait, 1 },
+	{ "history", builtin_history, 1 },
+	{ "output", builtin_output, 1 },
+	{ "ulimit", builtin_ulimit, 1 },
+	{ "fg", builtin_fg, 0 },
+	{ "bg", builtin_bg, 1 },
+	{ "alias", builtin_alias, 1 },
+	{ "unalias", builtin_unalias, 1 },
+	{ NULL, NULL, 0 }
+};
+
+// What find_builtin hands out for a function, the function leaves the
+// status of its last command
+struct builtin function_call = { "function", builtin_call, 0 };
+
+/******************************************************************************
+ * void run_list(struct shell *, struct command_list *)
+ * 
+ * Runs the commands of a line in order, skipping the ones whose && or ||
+ * doesn't hold for the status of the last command that ran. Each command is
+ * parsed and expanded right before it runs, so $? sees the command before
+ * it. A skipped command is still parsed if it has a here-document, whose
+ * body has to be read either way.
+ *****************************************************************************/
+void run_list(struct shell * sh, struct command_list * list){
+	struct pipeline pipeline;
+	struct loop * loop;
+	int succeeded;
+	int i = 0;
+	for(; i < list->count; i++){
+		succeeded = WIFEXITED(sh->status) && WEXITSTATUS(sh->status) == 0;
+		if((list->items[i].connector == LIST_AND && !succeeded) ||
+				(list->items[i].connector == LIST_OR && succeeded)){
+			if(has_heredoc(list->items[i].text) && parse_pipeline(list->items[i].text, &sh->arena, &pipeline) == 0)
+				read_heredocs(&sh->reader, &sh->arena, &pipeline);
+			continue;
+		}
+		if(is_loop(list->items[i].text)){
+			// compiled once for the line, then run without parsing again
+			loop = arena_alloc(&sh->arena, sizeof(struct loop));
+			if(compile_loop(sh, &sh->arena, list->items[i].text, loop) < 0)
+				sh->status = W_EXITCODE(1, 0);
+			else
+				run_loop(sh, loop);
+			continue;
+		}
+		if(parse_pipeline(list->items[i].text, &sh->arena, &pipeline) < 0){
+			sh->status = W_EXITCODE(1, 0);
+			continue;
+		}
+		expand_aliases(sh, &sh->arena, &pipeline);
+		if(expand_pipeline(sh, &sh->expanded, &sh->arena, &pipeline) < 0){
+			sh->status = W_EXITCODE(1, 0);
+			continue;
+		}
+		glob_pipeline(sh, &pipeline);
+		read_heredocs(&sh->reader, &sh->arena, &pipeline);
+		run_command(sh, &pipeline);
+	}
+}
+
+/******************************************************************************
+ * void run_compiled(struct shell *, struct compiled_list *)
+ * 
+ * Runs compiled commands the way run_list runs a line. The ones that were
+ * parsed when they were compiled run as they are, loops run from their
+ * compiled form, and the others are expanded and parsed first. Whatever
+ * that takes from the line's arena is given back after every command.
+ *****************************************************************************/
+void run_compiled(struct shell * sh, struct compiled_list * compiled){
+	struct command_list * list = &compiled->list;
+	struct arena_mark mark = arena_save(&sh->arena);
+	// our own, the caller's buffer may still hold our arguments
+	struct text_buffer expanded = { NULL, 0, 0 };
+	struct pipeline pipeline;
+	char * text;
+	int succeeded;
+	int i = 0;
+	for(; i < list->count; i++){
+		succeeded = WIFEXITED(sh->status) && WEXITSTATUS(sh->status) == 0;
+		if((list->items[i].connector == LIST_AND && !succeeded) ||
+				(list->items[i].connector == LIST_OR && succeeded))
+			continue;
+		if(compiled->loops[i] != NULL){
+			run_loop(sh, compiled->loops[i]);
+			arena_rewind(&sh->arena, &mark);
+			continue;
+		}
+		if(compiled->parsed[i] != NULL){
+			run_command(sh, compiled->parsed[i]);
+			arena_rewind(&sh->arena, &mark);
+			continue;
+		}
+		// parsing works in place, so it gets a copy of the text
+		text = arena_strdup(&sh->arena, list->items[i].text);
+		if(parse_pipeline(text, &sh->arena, &pipeline) < 0){
+			sh->status = W_EXITCODE(1, 0);
+			arena_rewind(&sh->arena, &mark);
+			continue;
+		}
+		expand_aliases(sh, &sh->arena, &pipeline);
+		if(expand_pipeline(sh, &expanded, &sh->arena, &pipeline) < 0){
+			sh->status = W_EXITCODE(1, 0);
+			arena_rewind(&sh->arena, &mark);
+			continue;
+		}
+		glob_pipeline(sh, &pipeline);
+		run_command(sh, &pipeline);
+		arena_rewind(&sh->arena, &mark);
+	}
+	free(expanded.data);
+}
+
+/******************************************************************************
+ * int compile_list(struct shell *, struct arena *, char *, struct compiled_list *)
+ * 
+ * Splits the text into its commands once, so they can be run any number of
+ * times. Every command that has nothing to expand or glob is parsed right
+ * away, with the aliases known now put in, and loops are compiled. The
+ * others are kept as text. Everything lives in the arena, the text too.
+ * Returns 0 on success and -1 if the text is malformed or has
+ * a here-document, which has no lines of its own to read a body from.
+ *****************************************************************************/
+int compile_list(struct shell * sh, struct arena * arena, char * text, struct compiled_list * compiled){
+	struct pipeline * pipeline;
+	struct redirect * redirect;
+	int i = 0;
+	int j;
+	if(split_list(text, arena, &compiled->list) < 0)
+		return -1;
+	compiled->parsed = arena_alloc(arena, (compiled->list.count + 1) * sizeof(struct pipeline *));
+	compiled->loops = arena_alloc(arena, (compiled->list.count + 1) * sizeof(struct loop *));
+	for(; i < compiled->list.count; i++){
+		text = compiled->list.items[i].text;
+		compiled->parsed[i] = NULL;
+		compiled->loops[i] = NULL;
+		if(is_loop(text)){
+			compiled->loops[i] = arena_alloc(arena, sizeof(struct loop));
+			if(compile_loop(sh, arena, text, compiled->loops[i]) < 0)
+				return -1;
+			continue;
+		}
+		if(has_heredoc(text)){
+			pipeline = arena_alloc(arena, sizeof(struct pipeline));
+			if(parse_pipeline(arena_strdup(arena, text), arena, pipeline) == 0){
+				for(j = 0; j < pipeline->num_cmds; j++){
+					for(redirect = pipeline->cmds[j].redirects; redirect != NULL; redirect = redirect->next){
+						if(redirect->type == REDIRECT_HEREDOC){
+							fprintf(stderr, "smallsh: here-documents can't be used in functions or loops\n");
+							return -1;
+						}
+					}
+				}
+			}
+		}
+		if(strchr(text, '$') != NULL || strpbrk(text, "*?[") != NULL)
+			continue;
+		pipeline = arena_alloc(arena, sizeof(struct pipeline));
+		if(parse_pipeline(text, arena, pipeline) < 0)
+			return -1;
+		expand_aliases(sh, arena, pipeline);
+		compiled->parsed[i] = pipeline;
+	}
+	return 0;
+}
+
+/******************************************************************************
+ * int compile_loop(struct shell *, struct arena *, char *, struct loop *)
+ * 
+ * Compiles a for NAME in WORDS ; do COMMANDS ; done or a while COMMANDS ;
+ * do COMMANDS ; done into the arena. The words of a for loop are kept as
+ * text, they are expanded every time the loop starts. Returns 0 on success
+ * and -1 if the loop is malformed.
+ *****************************************************************************/
+int compile_loop(struct shell * sh, struct arena * arena, char * text, struct loop * loop){
+	char * cursor;
+	char * word;
+	char * start;
+	char * do_word = NULL;
+	char * body = NULL;
+	char * done = NULL;
+	const char * kind;
+	size_t length;
+	int command = 1;
+	int depth = 1;
+	cursor = scan_word(text, &word, &length);
+	loop->is_for = is_keyword(word, length, "for");
+	kind = loop->is_for ? "for" : "while";
+	loop->name = NULL;
+	loop->words = NULL;
+	if(loop->is_for){
+		// for NAME in
+		cursor = scan_word(cursor, &word, &length);
+		if(word != NULL){
+			loop->name = arena_strndup(arena, word, length);
+			cursor = scan_word(cursor, &word, &length);
+		}
+		if(loop->name == NULL || !valid_variable(loop->name) || !is_keyword(word, length, "in")){
+			fprintf(stderr, "smallsh: for: expected for NAME in WORDS ; do COMMANDS ; done\n");
+			return -1;
+		}
+		command = 0;
+	}
+	start = cursor;
+	// find our do and the done that matches it, stepping over nested loops
+	while(1){
+		cursor = scan_word(cursor, &word, &length);
+		if(word == NULL)
+			break;
+		if(command && depth == 1 && do_word == NULL && is_keyword(word, length, "do")){
+			do_word = word;
+			body = cursor;
+		}
+		else if(command && (is_keyword(word, length, "for") || is_keyword(word, length, "while"))){
+			depth++;
+		}
+		else if(command && is_keyword(word, length, "done") && --depth == 0){
+			done = word;
+			break;
+		}
+		command = starts_command(word, length) || (command && is_keyword(word, length, "while"));
+	}
+	if(do_word == NULL || done == NULL){
+		fprintf(stderr, "smallsh: %s: missing %s\n", kind, do_word == NULL ? "do" : "done");
+		return -1;
+	}
+	scan_word(cursor, &word, &length);
+	if(word != NULL){
+		fprintf(stderr, "smallsh: syntax error near %.*s\n", (int)length, word);
+		return -1;
+	}
+	if(loop->is_for){
+		loop->words = arena_strndup(arena, start, do_word - start);
+	}
+	else if(compile_list(sh, arena, arena_strndup(arena, start, do_word - start), &loop->condition) < 0){
+		return -1;
+	}
+	else if(loop->condition.list.count == 0){
+		fprintf(stderr, "smallsh: while: missing the condition\n");
+		return -1;
+	}
+	return compile_list(sh, arena, arena_strndup(arena, body, done - body), &loop->body);
+}
+
+/******************************************************************************
+ * void run_loop(struct shell *, struct loop *)
+ * 
+ * Runs a compiled loop. A while loop runs its body for as long as its
+ * condition ends with a status of 0, a for loop once for each of its words
+ * with the variable set to it. The words are expanded and globbed once,
+ * before the first pass. A command killed by ^C ends the loop. The shell
+ * ignores ^C, so it is blocked while the loop runs, which keeps it pending
+ * instead, and it is looked for once a pass. That ends a loop of built ins
+ * as if they had been killed by it too. The status is the one of the last
+ * pass, or 0 if there was none.
+ *****************************************************************************/
+void run_loop(struct shell * sh, struct loop * loop){
+	struct text_buffer expanded = { NULL, 0, 0 };
+	struct command words;
+	struct pipeline pipeline;
+	sigset_t interrupt;
+	sigset_t saved;
+	int status = W_EXITCODE(0, 0);
+	int capacity = INITIAL_ARGS;
+	char * text;
+	char * cursor;
+	char * word;
+	int i = 0;
+	sigemptyset(&interrupt);
+	sigaddset(&interrupt, SIGINT);
+	sigprocmask(SIG_BLOCK, &interrupt, &saved);
+	if(!loop->is_for){
+		while(1){
+			if(interrupted(&interrupt)){
+				status = W_EXITCODE(0, SIGINT);
+				break;
+			}
+			run_compiled(sh, &loop->condition);
+			if(!WIFEXITED(sh->status) || WEXITSTATUS(sh->status) != 0)
+				break;
+			run_compiled(sh, &loop->body);
+			status = sh->status;
+			if(WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+				break;
+		}
+		sigprocmask(SIG_SETMASK, &saved, NULL);
+		sh->status = status;
+		return;
+	}
+	// split them the way parse_pipeline would, into a command to expand
+	// and glob
+	text = arena_strdup(&sh->arena, loop->words);
+	words.argv = arena_alloc(&sh->arena, (capacity + 1) * sizeof(char *));
+	words.argc = 0;
+	words.redirects = NULL;
+	words.num_redirects = 0;
+	cursor = text;
+	while((word = next_token(&cursor)) != NULL){
+		// the ; in front of the do
+		if(strcmp(word, ";") == 0)
+			continue;
+		if(words.argc == capacity){
+			char ** bigger = arena_alloc(&sh->arena, (2 * capacity + 1) * sizeof(char *));
+			memcpy(bigger, words.argv, capacity * sizeof(char *));
+			words.argv = bigger;
+			capacity *= 2;
+		}
+		words.argv[words.argc++] = word;
+	}
+	words.argv[words.argc] = NULL;
+	words.argv = expand_words(sh, &expanded, &sh->arena, words.argv, words.argc, &words.argc);
+	if(words.argv == NULL){
+		sigprocmask(SIG_SETMASK, &saved, NULL);
+		free(expanded.data);
+		sh->status = W_EXITCODE(1, 0);
+		return;
+	}
+	pipeline.cmds = &words;
+	pipeline.num_cmds = 1;
+	glob_pipeline(sh, &pipeline);
+	for(; i < words.argc; i++){
+		if(interrupted(&interrupt)){
+			status = W_EXITCODE(0, SIGINT);
+			break;
+		}
+		if(setenv(loop->name, words.argv[i], 1) < 0){
+			fprintf(stderr, "smallsh: for: %s: %s\n", loop->name, strerror(errno));
+			status = W_EXITCODE(1, 0);
+			break;
+		}
+		run_compiled(sh, &loop->body);
+		status = sh->status;
+		if(WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+			break;
+	}
+	sigprocmask(SIG_SETMASK, &saved, NULL);
+	free(expanded.data);
+	sh->status = status;
+}
+
+/******************************************************************************
+ * int interrupted(sigset_t *)
+ * 
+ * Takes a pending ^C out of the blocked set without waiting, and returns
+ * whether there was one.
+ *****************************************************************************/
+int interrupted(sigset_t * interrupt){
+	struct timespec now = { 0, 0 };
+	return sigtimedwait(interrupt, NULL, &now) == SIGINT;
+}
+
+/******************************************************************************
+ * char * scan_word(char *, char **, size_t *)
+ * 
+ * Finds the next word at the cursor without touching the text, the way
+ * split_list sees words, and returns the cursor after it. The word is NULL
+ * at the end of the text.
+ *****************************************************************************/
+char * scan_word(char * cursor, char ** word, size_t * length){
+	char * end;
+	while(*cursor == ' ' || *cursor == '\t' || *cursor == '\n')
+		cursor++;
+	*word = NULL;
+	*length = 0;
+	if(*cursor == '\0')
+		return cursor;
+	end = cursor;
+	while(*end != '\0' && *end != ' ' && *end != '\t' && *end != '\n'){
+		if(end[0] == '$' && end[1] == '(' && substitution_end(end) != NULL)
+			end = substitution_end(end);
+		end++;
+	}
+	*word = cursor;
+	*length = end - cursor;
+	return end;
+}
+
+/******************************************************************************
+ * int loop_depth(char *, char **)
+ * 
+ * Counts the loops the text opens with for or while and closes with done,
+ * where those start a command. If end isn't NULL it stops at the end of the
+ * first loop, sets end to just after its done and returns 0. Returns how
+ * many loops are still open.
+ *****************************************************************************/
+int loop_depth(char * text, char ** end){
+	char * word;
+	size_t length;
+	int command = 1;
+	int depth = 0;
+	while(1){
+		text = scan_word(text, &word, &length);
+		if(word == NULL)
+			return depth;
+		if(command && (is_keyword(word, length, "for") || is_keyword(word, length, "while"))){
+			depth++;
+		}
+		else if(command && depth > 0 && is_keyword(word, length, "done") && --depth == 0 && end != NULL){
+			*end = text;
+			return 0;
+		}
+		command = starts_command(word, length) || (command && is_keyword(word, length, "while"));
+	}
+}
+
+/******************************************************************************
+ * int is_loop(char *)
+ * 
+ * Returns whether the command starts a for or a while loop.
+ *****************************************************************************/
+int is_loop(char * text){
+	char * word;
+	size_t length;
+	scan_word(text, &word, &length);
+	return is_keyword(word, length, "for") || is_keyword(word, length, "while");
+}
+
+/******************************************************************************
+ * int is_keyword(const char *, size_t, const char *)
+ * 
+ * Returns whether the word of that length is the keyword.
+ *****************************************************************************/
+int is_keyword(const char * word, size_t length, const char * keyword){
+	return word != NULL && length == strlen(keyword) && strncmp(word, keyword, length) == 0;
+}
+
+/******************************************************************************
+ * int starts_command(const char *, size_t)
+ * 
+ * Returns whether a command starts after the word: it is a separator, a |
+ * or the do of a loop.
+ *****************************************************************************/
+int starts_command(const char * word, size_t length){
+	return is_keyword(word, length, ";") || is_keyword(word, length, "&") ||
+		is_keyword(word, length, "|") || is_keyword(word, length, "&&") ||
+		is_keyword(word, length, "||") || is_keyword(word, length, "do");
+}
+
+/******************************************************************************
+ * int valid_variable(const char *)
+ * 
+ * Returns whether the word can name a variable: letters, digits and _ that
+ * don't start with a digit.
+ *****************************************************************************/
+int valid_variable(const char * name){
+	if(*name == '\0' || (*name >= '0' && *name <= '9'))
+		return 0;
+	for(; *name != '\0'; name++){
+		if(!((*name >= 'A' && *name <= 'Z') || (*name >= 'a' && *name <= 'z') ||
+				(*name >= '0' && *name <= '9') || *name == '_'))
+			return 0;
+	}
+	return 1;
+}
+
+/******************************************************************************
+ * int builtin_call(struct shell *, char **)
+ * 
+ * Runs the function named by the first word with the others as its
+ * arguments, $1 to $9, $# and $@ while it runs. Returns the exit code of
+ * its last command.
+ *****************************************************************************/
+int builtin_call(struct shell * sh, char ** commands){
+	struct definition * def = find_definition(sh, commands[0]);
+	char ** args = sh->args;
+	int num_args = sh->num_args;
+	// we leave the status ourselves, so errors have to set it too
+	if(def == NULL || def->is_alias){
+		sh->status = W_EXITCODE(1, 0);
+		return 1;
+	}
+	if(sh->call_depth >= FUNCTION_DEPTH){
+		fprintf(stderr, "smallsh: %s: functions nested too deep\n", commands[0]);
+		sh->status = W_EXITCODE(1, 0);
+		return 1;
+	}
+	sh->args = commands;
+	for(sh->num_args = 0; commands[sh->num_args + 1] != NULL; sh->num_args++)
+		;
+	sh->call_depth++;
+	def->calls++;
+	run_compiled(sh, &def->body);
+	def->calls--;
+	sh->call_depth--;
+	sh->args = args;
+	sh->num_args = num_args;
+	return exit_code(sh->status);
+}
+
+/******************************************************************************
+ * int define_function(struct shell *, char *)
+ * 
+ * Defines the function of a line that starts with function NAME {. The
+ * body runs up to a } at the end of this line or of one of the lines after
+ * it, which become commands of their own. Every command of the body that
+ * has nothing to expand is parsed right away, with the aliases known now
+ * put in. Just function lists the functions. Returns 0 on success and -1
+ * if the definition is malformed.
+ *****************************************************************************/
+int define_function(struct shell * sh, char * line){
+	struct text_buffer body = { NULL, 0, 0 };
+	struct definition * def;
+	char * cursor = line;
+	char * name;
+	char * open;
+	char * text;
+	struct builtin * builtin;
+	int i = 0;
+	next_token(&cursor);
+	name = next_token(&cursor);
+	if(name == NULL){
+		for(; i < DEFINITION_TABLE_SIZE; i++)
+			for(def = sh->definitions.buckets[i]; def != NULL; def = def->next)
+				if(!def->is_alias)
+					printf("function %s { %s }\n", def->name, def->text);
+		return 0;
+	}
+	open = next_token(&cursor);
+	if(open == NULL || strcmp(open, "{") != 0){
+		fprintf(stderr, "smallsh: function: expected function NAME { COMMANDS }\n");
+		return -1;
+	}
+	builtin = find_builtin(sh, name);
+	if(!valid_name(name) || (builtin != NULL && builtin != &function_call)){
+		fprintf(stderr, "smallsh: function: %s: not a name a function can have\n", name);
+		return -1;
+	}
+	// keep the name, reading on may move the line
+	name = arena_strdup(&sh->arena, name);
+	text_append(&body, cursor, strlen(cursor));
+	while(!body_closed(&body)){
+		if(read_continued(sh, &body) < 0){
+			fprintf(stderr, "smallsh: function: %s: missing }\n", name);
+			free(body.data);
+			return -1;
+		}
+	}
+	text_append(&body, "", 1);
+	if(remove_definition(sh, name) < 0){
+		free(body.data);
+		return -1;
+	}
+	def = add_definition(sh, name, 0);
+	def->text = arena_strdup(&def->arena, body.data);
+	text = arena_strdup(&def->arena, body.data);
+	free(body.data);
+	if(compile_list(sh, &def->arena, text, &def->body) < 0){
+		remove_definition(sh, name);
+		return -1;
+	}
+	return 0;
+}
+
+/******************************************************************************
+ * int read_continued(struct shell *, struct text_buffer *)
+ * 
+ * Reads the next line that has a command on it and adds it to the text as
+ * a command of its own, or as the rest of the last one if that goes on.
+ * The text stays null terminated. Returns -1 if the input ended first.
+ *****************************************************************************/
+int read_continued(struct shell * sh, struct text_buffer * text){
+	char * line;
+	while(1){
+		if(sh->reader.interactive){
+			printf("> ");
+			fflush(stdout);
+		}
+		line = reader_next(&sh->reader);
+		if(line == NULL)
+			return -1;
+		while(*line == ' ' || *line == '\t')
+			line++;
+		// blank lines and comments have nothing to run
+		if(*line != '\0' && *line != '#')
+			break;
+	}
+	if(!list_continues(text))
+		text_append(text, " ; ", 3);
+	else
+		text_append(text, " ", 1);
+	text_append(text, line, strlen(line) + 1);
+	text->length--;
+	return 0;
+}
+
+/******************************************************************************
+ * int body_closed(struct text_buffer *)
+ * 
+ * Returns whether the body of a function read so far ends with a } word,
+ * and drops the } if so.
+ *****************************************************************************/
+int body_closed(struct text_buffer * body){
+	size_t end = body->length;
+	while(end > 0 && (body->data[end - 1] == ' ' || body->data[end - 1] == '\t'))
+		end--;
+	if(end == 0 || body->data[end - 1] != '}')
+		return 0;
+	if(end > 1 && body->data[end - 2] != ' ' && body->data[end - 2] != '\t')
+		return 0;
+	body->length = end - 1;
+	return 1;
+}
+
+/******************************************************************************
+ * int list_continues(struct text_buffer *)
+ * 
+ * Returns whether the text read so far is empty or ends with a separator,
+ * a | or a do, so that the next line goes on from it.
+ *****************************************************************************/
+int list_continues(struct text_buffer * body){
+	size_t end = body->length;
+	char last;
+	while(end > 0 && (body->data[end - 1] == ' ' || body->data[end - 1] == '\t'))
+		end--;
+	if(end == 0)
+		return 1;
+	// a loop's do goes on with its first command
+	if(end >= 2 && strncmp(body->data + end - 2, "do", 2) == 0 &&
+			(end == 2 || body->data[end - 3] == ' ' || body->data[end - 3] == '\t'))
+		return 1;
+	last = body->data[end - 1];
+	if(last != ';' && last != '&' && last != '|')
+		return 0;
+	// only a separator word counts, not the end of 2>&1
+	if(end > 1 && (body->data[end - 2] == last))
+		end--;
+	return end == 1 || body->data[end - 2] == ' ' || body->data[end - 2] == '\t';
+}
+
+/******************************************************************************
+ * int builtin_alias(struct shell *, char **)
+ * 
+ * Defines NAME=WORDS as an alias for the words, which go in front of the
+ * arguments of any command that starts with NAME. The words are parsed
+ * once, here, and may not hold pipes, lists or redirects. Without
+ * arguments lists the aliases, with just a NAME prints that one. Returns 0
+ * on success and 1 if anything was wrong.
+ *****************************************************************************/
+int builtin_alias(struct shell * sh, char ** commands){
+	struct definition * def;
+	struct text_buffer words = { NULL, 0, 0 };
+	struct pipeline pipeline;
+	char * equals;
+	int i = 0;
+	int j;
+	if(commands[1] == NULL){
+		for(; i < DEFINITION_TABLE_SIZE; i++){
+			for(def = sh->definitions.buckets[i]; def != NULL; def = def->next){
+				if(!def->is_alias)
+					continue;
+				printf("alias %s=", def->name);
+				for(j = 0; j < def->alias->argc; j++)
+					printf(j > 0 ? " %s" : "%s", def->alias->argv[j]);
+				printf("\n");
+			}
+		}
+		return 0;
+	}
+	equals = strchr(commands[1], '=');
+	if(equals == NULL){
+		def = find_definition(sh, commands[1]);
+		if(def == NULL || !def->is_alias){
+			fprintf(stderr, "smallsh: alias: %s: not found\n", commands[1]);
+			return 1;
+		}
+		printf("alias %s=", def->name);
+		for(j = 0; j < def->alias->argc; j++)
+			printf(j > 0 ? " %s" : "%s", def->alias->argv[j]);
+		printf("\n");
+		return 0;
+	}
+	*equals = '\0';
+	if(!valid_name(commands[1])){
+		fprintf(stderr, "smallsh: alias: %s: not a name an alias can have\n", commands[1]);
+		*equals = '=';
+		return 1;
+	}
+	// the words are the rest of this one and all the ones after it
+	text_append(&words, equals + 1, strlen(equals + 1));
+	for(i = 2; commands[i] != NULL; i++){
+		text_append(&words, " ", 1);
+		text_append(&words, commands[i], strlen(commands[i]));
+	}
+	text_append(&words, "", 1);
+	if(remove_definition(sh, commands[1]) < 0){
+		*equals = '=';
+		free(words.data);
+		return 1;
+	}
+	def = add_definition(sh, commands[1], 1);
+	*equals = '=';
+	if(parse_pipeline(arena_strdup(&def->arena, words.data), &def->arena, &pipeline) < 0 ||
+			pipeline.num_cmds != 1 || pipeline.cmds[0].num_redirects > 0 || !pipeline.fg ||
+			pipeline.timed || pipeline.cpus != NULL){
+		fprintf(stderr, "smallsh: alias: %s: an alias can only stand for words, use a function\n", def->name);
+		remove_definition(sh, def->name);
+		free(words.data);
+		return 1;
+	}
+	free(words.data);
+	def->alias = pipeline.cmds;
+	return 0;
+}
+
+/******************************************************************************
+ * int builtin_unalias(struct shell *, char **)
+ * 
+ * Removes each named alias. Returns 1 if one of them wasn't an alias.
+ *****************************************************************************/
+int builtin_unalias(struct shell * sh, char ** commands){
+	struct definition * def;
+	int result = 0;
+	int i = 1;
+	for(; commands[i] != NULL; i++){
+		def = find_definition(sh, commands[i]);
+		if(def == NULL || !def->is_alias){
+			fprintf(stderr, "smallsh: unalias: %s: not found\n", commands[i]);
+			result = 1;
+			continue;
+		}
+		remove_definition(sh, commands[i]);
+	}
+	return result;
+}
+
+/******************************************************************************
+ * void expand_aliases(struct shell *, struct arena *, struct pipeline *)
+ * 
+ * Puts the words of an alias in front of the arguments of every command of
+ * the pipeline that starts with it. The words are copied into the arena, so
+ * the pipeline doesn't depend on the alias staying around. Aliases aren't
+ * expanded again inside an alias.
+ *****************************************************************************/
+void expand_aliases(struct shell * sh, struct arena * arena, struct pipeline * pipeline){
+	struct definition * def;
+	struct command * cmd;
+	char ** argv;
+	int i = 0;
+	int j;
+	if(sh->definitions.count == 0)
+		return;
+	for(; i < pipeline->num_cmds; i++){
+		cmd = &pipeline->cmds[i];
+		def = find_definition(sh, cmd->argv[0]);
+		if(def == NULL || !def->is_alias)
+			continue;
+		argv = arena_alloc(arena, (def->alias->argc + cmd->argc) * sizeof(char *));
+		for(j = 0; j < def->alias->argc; j++)
+			argv[j] = arena_strdup(arena, def->alias->argv[j]);
+		// the arguments follow, and the null that ends them
+		memcpy(argv + j, cmd->argv + 1, cmd->argc * sizeof(char *));
+		cmd->argv = argv;
+		cmd->argc += def->alias->argc - 1;
+	}
+}
+
+/******************************************************************************
+ * struct definition * find_definition(struct shell *, const char *)
+ * 
+ * Looks up an alias or a function by name. Returns NULL if there is none.
+ *****************************************************************************/
+struct definition * find_definition(struct shell * sh, const char * name){
+	struct definition * def;
+	if(sh->definitions.count == 0)
+		return NULL;
+	def = sh->definitions.buckets[string_hash(name) & (DEFINITION_TABLE_SIZE - 1)];
+	for(; def != NULL; def = def->next)
+		if(strcmp(def->name, name) == 0)
+			return def;
+	return NULL;
+}
+
+/******************************************************************************
+ * struct definition * add_definition(struct shell *, const char *, int)
+ * 
+ * Adds an empty alias or function by that name, which mustn't be taken.
+ * Returns the new definition.
+ *****************************************************************************/
+struct definition * add_definition(struct shell * sh, const char * name, int is_alias){
+	struct definition ** bucket = &sh->definitions.buckets[string_hash(name) & (DEFINITION_TABLE_SIZE - 1)];
+	struct definition * def = calloc(1, sizeof(struct definition));
+	if(def == NULL){
+		fprintf(stderr, "smallsh: out of memory\n");
+		exit(1);
+	}
+	def->name = arena_strdup(&def->arena, name);
+	def->is_alias = is_alias;
+	def->next = *bucket;
+	*bucket = def;
+	sh->definitions.count++;
+	return def;
+}
+
+/******************************************************************************
+ * int remove_definition(struct shell *, const char *)
+ * 
+ * Removes the alias or function by that name, if there is one. A function
+ * that is running can't go. Returns 0 on success and -1 if it can't.
+ *****************************************************************************/
+int remove_definition(struct shell * sh, const char * name){
+	struct definition ** link = &sh->definitions.buckets[string_hash(name) & (DEFINITION_TABLE_SIZE - 1)];
+	struct definition * def;
+	for(; *link != NULL; link = &(*link)->next){
+		def = *link;
+		if(strcmp(def->name, name) != 0)
+			continue;
+		if(def->calls > 0){
+			fprintf(stderr, "smallsh: %s: the function is running\n", name);
+			return -1;
+		}
+		*link = def->next;
+		sh->definitions.count--;
+		definition_free(def);
+		return 0;
+	}
+	return 0;
+}
+
+/******************************************************************************
+ * void definition_free(struct definition *)
+ * 
+ * Frees an alias or function and everything it owns.
+ *****************************************************************************/
+void definition_free(struct definition * def){
+	arena_free(&def->arena);
+	free(def);
+}
+
+/******************************************************************************
+ * int valid_name(const char *)
+ * 
+ * Returns whether the word can name an alias or a function: letters,
+ * digits, _, - and . that don't start with a digit or -.
+ *****************************************************************************/
+int valid_name(const char * name){
+	if(*name == '\0' || (*name >= '0' && *name <= '9') || *name == '-')
+		return 0;
+	for(; *name != '\0'; name++){
+		if(!((*name >= 'A' && *name <= 'Z') || (*name >= 'a' && *name <= 'z') ||
+				(*name >= '0' && *name <= '9') || *name == '_' || *name == '-' || *name == '.'))
+			return 0;
+	}
+	return 1;
+}
+
+/******************************************************************************
+ * unsigned int string_hash(const char *)
+ * 
+ * FNV-1a hash of a string.
+ *****************************************************************************/
+unsigned int string_hash(const char * str){
+	unsigned int hash = 2166136261u;
+	for(; *str != '\0'; str++){
+		hash ^= (unsigned char)*str;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/******************************************************************************
+ * void builtin_index_init(struct shell *)
+ * 
+ * Builds the hash table of built in commands, probing linearly on collisions.
+ *****************************************************************************/
+void builtin_index_init(struct shell * sh){
+	struct builtin * builtin = builtins;
+	memset(sh->builtin_index, 0, sizeof(sh->builtin_index));
+	for(; builtin->name != NULL; builtin++){
+		unsigned int i = string_hash(builtin->name) & (BUILTIN_INDEX_SIZE - 1);
+		while(sh->builtin_index[i] != NULL)
+			i = (i + 1) & (BUILTIN_INDEX_SIZE - 1);
+		sh->builtin_index[i] = builtin;
+	}
+}
+
+/******************************************************************************
+ * struct builtin * find_builtin(struct shell *, const char *)
+ * 
+ * Looks up a built in command by name. A function is run by function_call,
+ * so that it runs in the shell wherever a built in would. Returns NULL if
+ * there is neither.
+ *****************************************************************************/
+struct builtin * find_builtin(struct shell * sh, const char * name){
+	unsigned int i = string_hash(name) & (BUILTIN_INDEX_SIZE - 1);
+	struct definition * def;
+	while(sh->builtin_index[i] != NULL){
+		if(strcmp(sh->builtin_index[i]->name, name) == 0)
+			return sh->builtin_index[i];
+		i = (i + 1) & (BUILTIN_INDEX_SIZE - 1);
+	}
+	def = find_definition(sh, name);
+	if(def != NULL && !def->is_alias)
+		return &function_call;
+	return NULL;
+}
+
+/******************************************************************************
+ * int swap_fd(int, struct redirect *, int *)
+ * 
+ * Applies the redirect to the target descriptor of the shell itself, keeping
+ * a close on exec copy of the old descriptor in saved so it can be put back.
+ * Returns 0 on success and -1 if the file couldn't be opened.
+ *****************************************************************************/
+int swap_fd(int target, struct redirect * redirect, int * saved){
+	int fd = open_redirect(redirect);
+	if(fd < 0)
+		return -1;
+	// a descriptor that isn't open has nothing to restore
+	*saved = fcntl(target, F_DUPFD_CLOEXEC, SHELL_FDS);
+	if(fd != target)
+		dup2(fd, target);
+	if(redirect->type != REDIRECT_DUP)
+		close(fd);
+	return 0;
+}
+
+/******************************************************************************
+ * void restore_fd(int, int)
+ * 
+ * Puts back a descriptor saved by swap_fd, or closes it again if it was
+ * opened by the redirect.
+ *****************************************************************************/
+void restore_fd(int target, int saved){
+	// the descriptor wasn't open before the redirect
+	if(saved < 0){
+		close(target);
+		return;
+	}
+	dup2(saved, target);
+	close(saved);
+}
+
+/******************************************************************************
+ * void run_builtin(struct shell *, struct builtin *, struct command *)
+ * 
+ * Runs a built in command inside the shell. The redirects are honored by
+ * swapping the shell's descriptors for the duration of the command, and put
+ * back in reverse order afterwards.
+ *****************************************************************************/
+void run_builtin(struct shell * sh, struct builtin * builtin, struct command * cmd){
+	struct redirect ** applied = arena_alloc(&sh->arena, (cmd->num_redirects + 1) * sizeof(struct redirect *));
+	int * saved = arena_alloc(&sh->arena, (cmd->num_redirects + 1) * sizeof(int));
+	struct redirect * redirect;
+	int num_applied = 0;
+	int code = -1;
+	// whatever is buffered belongs to the old descriptors
+	if(cmd->num_redirects > 0)
+		fflush(stdout);
+	for(redirect = cmd->redirects; redirect != NULL; redirect = redirect->next){
+		if(swap_fd(redirect->fd, redirect, &saved[num_applied]) < 0){
+			event_redirect(sh, cmd, redirect, errno);
+			break;
+		}
+		applied[num_applied++] = redirect;
+	}
+	if(redirect == NULL)
+		code = builtin->run(sh, cmd->argv);
+	if(cmd->num_redirects > 0)
+		fflush(stdout);
+	// undo the swaps last to first, so each gets back what it replaced
+	while(num_applied-- > 0)
+		restore_fd(applied[num_applied]->fd, saved[num_applied]);
+	if(code < 0)
+		sh->status = W_EXITCODE(1, 0);
+	else if(builtin->sets_status)
+		sh->status = W_EXITCODE(code, 0);
+}
+
+/******************************************************************************
+ * int builtin_cd(struct shell *, char **)
+ * 
+ * Changes the directory to the directory specified by the commands string 
+ * array. If there is no directory specified, change to home directory.
+ *****************************************************************************/
+int builtin_cd(struct shell * sh, char ** commands){
+	(void)sh;
+	// if the user specified a directory, change to it, else change to home
+	char * dir = commands[1] != NULL ? commands[1] : getenv("HOME");
+	if(dir == NULL || chdir(dir) < 0){
+		fprintf(stderr, "smallsh: cd: %s: %s\n", dir ? dir : "HOME not set", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+/******************************************************************************
+ * int builtin_status(struct shell *, char **)
+ * 
+ * If the user wants the status, give it to them. Doesn't change the status.
+ *****************************************************************************/
+int builtin_status(struct shell * sh, char ** commands){
+	(void)commands;
+	get_status(&sh->status);
+	return 0;
+}
+
+/******************************************************************************
+ * int builtin_exit(struct shell *, char **)
+ * 
+ * If the user wants to exit, exit. A forked copy of the shell, running a
+ * substitution or a pipeline stage, only ends itself.
+ *****************************************************************************/
+int builtin_exit(struct shell * sh, char ** commands){
+	(void)commands;
+	// a copy has no jobs to shut down, and must not touch the real ones
+	if(sh->forked){
+		fflush(stdout);
+		events_flush(&sh->events);
+		_exit(exit_code(sh->status));
+	}
+	exit_shell(sh);
+	return 0;
+}
+
+/******************************************************************************
+ * int builtin_echo(struct shell *, char **)
+ * 
+ * Prints the arguments separated by spaces. -n leaves off the newline.
+ *****************************************************************************/
+int builtin_echo(struct shell * sh, char ** commands){
+	(void)sh;
+	int newline = 1;
+	int i = 1;
+	if(commands[1] != NULL && strcmp(commands[1], "-n") == 0){
+		newline = 0;
+		i++;
+	}
+	for(; commands[i] != NULL; i++){
+		fputs(commands[i], stdout);
+		if(commands[i + 1] != NULL)
+			putchar(' ');
+	}
+	if(newline)
+		putchar('\n');
+	return 0;
+}
+
+/******************************************************************************
+ * int builtin_true(struct shell *, char **)
+ * 
+ * Does nothing, successfully.
+ *****************************************************************************/
+int builtin_true(struct shell * sh, char ** commands){
+	(void)sh;
+	(void)commands;
+	return 0;
+}
+
+/******************************************************************************
+ * int builtin_false(struct shell *, char **)
+ * 
+ * Does nothing, unsuccessfully.
+ *****************************************************************************/
+int builtin_false(struct shell * sh, char ** commands){
+	(void)sh;
+	(void)commands;
+	return 1;
+}
+
+/******************************************************************************
+ * int builtin_pwd(struct shell *, char **)
+ * 
+ * Prints the current working directory.
+ *****************************************************************************/
+int builtin_pwd(struct shell * sh, char ** commands){
+	(void)sh;
+	(void)commands;
+	char cwd[PATH_MAX];
+	if(getcwd(cwd, sizeof(cwd)) == NULL){
+		fprintf(stderr, "smallsh: pwd: %s\n", strerror(errno));
+		return 1;
+	}
+	printf("%s\n", cwd);
+	return 0;
+}
+
+/******************************************************************************
+ * int builtin_export(struct shell *, char **)
+ * 
+ * Sets each NAME=VALUE argument in the environment, which is passed on to
+ * every child. With no arguments, prints the environment.
+ *****************************************************************************/
+int builtin_export(struct shell * sh, char ** commands){
+	(void)sh;
+	int result = 0;
+	int i = 1;
+	if(commands[1] == NULL){
+		char ** var = environ;
+		for(; *var != NULL; var++)
+			printf("export %s\n", *var);
+		return 0;
+	}
+	for(; commands[i] != NULL; i++){
+		char * equals = strchr(commands[i], '=');
+		// every variable is already in the environment, so a plain
+		// NAME has nothing left to do
+		if(equals == NULL)
+			continue;
+		*equals = '\0';
+		if(setenv(commands[i], equals + 1, 1) < 0){
+			fprintf(stderr, "smallsh: export: %s: %s\n", commands[i], strerror(errno));
+			result = 1;
+		}
+		*equals = '=';
+	}
+	return result;
+}
+
+/******************************************************************************
+ * int builtin_unset(struct shell *, char **)
+ * 
+ * Removes each named variable from the environment.
+ *****************************************************************************/
+int builtin_unset(struct shell * sh, char ** commands){
+	struct definition * def;
+	int result = 0;
+	int i = 1;
+	if(commands[1] != NULL && strcmp(commands[1], "-f") == 0){
+		// unset -f NAME removes functions instead
+		for(i = 2; commands[i] != NULL; i++){
+			def = find_definition(sh, commands[i]);
+			if(def == NULL || def->is_alias || remove_definition(sh, commands[i]) < 0)
+				result = 1;
+		}
+		return result;
+	}
+	for(; commands[i] != NULL; i++){
+		if(unsetenv(commands[i]) < 0){
+			fprintf(stderr, "smallsh: unset: %s: %s\n", commands[i], strerror(errno));
+			result = 1;
+		}
+	}
+	return result;
+}
+
+/******************************************************************************
+ * int builtin_test(struct shell *, char **)
+ * 
+ * The test and [ commands. [ needs a closing ] as its last argument.
+ * Returns 0 if the expression is true, 1 if it is false, and 2 on errors.
+ *****************************************************************************/
+int builtin_test(struct shell * sh, char ** commands){
+	(void)sh;
+	int argc = 0;
+	while(commands[argc] != NULL)
+		argc++;
+	if(strcmp(commands[0], "[") == 0){
+		if(strcmp(commands[argc - 1], "]") != 0){
+			fprintf(stderr, "smallsh: [: missing ]\n");
+			return 2;
+		}
+		argc--;
+	}
+	return evaluate_test(argc - 1, commands + 1);
+}
+
+/******************************************************************************
+ * int builtin_hash(struct shell *, char **)
+ * 
+ * With no arguments, lists the remembered commands. hash -r forgets all of
+ * them, and hash NAME... looks the names up and remembers them.
+ *****************************************************************************/
+int builtin_hash(struct shell * sh, char ** commands){
+	int result = 0;
+	int i = 1;
+	if(commands[1] == NULL){
+		for(i = 0; i < PATH_CACHE_SIZE; i++){
+			struct path_entry * entry = sh->commands.buckets[i];
+			for(; entry != NULL; entry = entry->next)
+				printf("%s\t%s\n", entry->name, entry->path);
+		}
+		return 0;
+	}
+	if(strcmp(commands[1], "-r") == 0){
+		clear_path_cache(&sh->commands);
+		return 0;
+	}
+	for(; commands[i] != NULL; i++){
+		if(resolve_command(sh, commands[i]) == NULL){
+			fprintf(stderr, "smallsh: hash: %s: not found\n", commands[i]);
+			result = 1;
+		}
+	}
+	return result;
+}
+
+/******************************************************************************
+ * int builtin_parallel(struct shell *, char **)
+ * 
+ * parallel [-j N] [FILE] runs every line of FILE, or of stdin, as a
+ * background job with at most N of them running at once. When stdin is
+ * where the shell reads its own commands, the jobs are the rest of that
+ * input, taken from the shell's reader so nothing is read twice or
+ * missed. A slot is refilled
+ * as soon as one of its jobs is reaped. The lines are parsed in an arena of
+ * their own that is rewound after each launch. Jobs that fail and lines
+ * that don't parse are reported by their line number once the batch is
+ * done, and the exit code is 1 if there were any.
+ *****************************************************************************/
+int builtin_parallel(struct shell * sh, char ** commands){
+	struct job_table * jobs = &sh->jobs;
+	struct line_reader own;
+	struct line_reader * reader = &own;
+	struct arena arena = { NULL, NULL };
+	struct pipeline pipeline;
+	struct pollfd fds;
+	// our own, the shell's buffer still holds this command
+	struct text_buffer expanded = { NULL, 0, 0 };
+	long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	// the line each job came from
+	long * lines;
+	long number;
+	long first;
+	int num_jobs = 0;
+	int capacity = 64;
+	int failed = 0;
+	int done = 0;
+	int fd = 0;
+	int i = 1;
+	char * line;
+	if(commands[1] != NULL && strcmp(commands[1], "-j") == 0){
+		if(commands[2] == NULL || (max_jobs = atoi(commands[2])) <= 0){
+			fprintf(stderr, "smallsh: parallel: -j needs a positive number\n");
+			return 2;
+		}
+		i = 3;
+	}
+	if(max_jobs < 1)
+		max_jobs = 1;
+	if(commands[i] != NULL){
+		fd = open(commands[i], O_RDONLY | O_CLOEXEC);
+		if(fd < 0){
+			fprintf(stderr, "smallsh: parallel: %s: %s\n", commands[i], strerror(errno));
+			return 2;
+		}
+	}
+	// a copy of the shell may have another stdin than its reader
+	if(fd == 0 && sh->reader.fd == 0 && !sh->forked)
+		reader = &sh->reader;
+	else
+		reader_init(reader, fd, 0);
+	first = reader->lines;
+	jobs->batch_status = malloc(capacity * sizeof(int));
+	lines = malloc(capacity * sizeof(long));
+	jobs->batch_running = 0;
+	while(!done || jobs->batch_running > 0){
+		// start jobs until every slot is busy
+		while(!done && jobs->batch_running < max_jobs){
+			line = reader_next(reader);
+			if(line == NULL){
+				done = 1;
+				break;
+			}
+			// a here-document's body is read after it, so take it first
+			number = reader->lines - first;
+			if(num_jobs == capacity){
+				capacity *= 2;
+				jobs->batch_status = realloc(jobs->batch_status, capacity * sizeof(int));
+				lines = realloc(lines, capacity * sizeof(long));
+			}
+			lines[num_jobs] = number;
+			arena_reset(&arena);
+			if(!reader->mapped && has_heredoc(line))
+				line = arena_strdup(&arena, line);
+			if(parse_pipeline(line, &arena, &pipeline) < 0){
+				// -1 is no wait status, it marks a line that never ran
+				jobs->batch_status[num_jobs++] = -1;
+				continue;
+			}
+			expand_aliases(sh, &arena, &pipeline);
+			if(expand_pipeline(sh, &expanded, &arena, &pipeline) < 0){
+				jobs->batch_status[num_jobs++] = -1;
+				continue;
+			}
+			glob_pipeline(sh, &pipeline);
+			read_heredocs(reader, &arena, &pipeline);
+			if(pipeline.num_cmds == 0)
+				continue;
+			pipeline.fg = 0;
+			pipeline.batch_index = num_jobs;
+			if(handle_fork_exec(sh, &pipeline) >= 0)
+				jobs->batch_running++;
+			else
+				jobs->batch_status[num_jobs] = sh->status;
+			num_jobs++;
+		}
+		if(jobs->batch_running == 0)
+			continue;
+		// sleep until a child exits, then go refill its slot
+		fds.fd = sh->signal_fd;
+		fds.events = POLLIN;
+		if(poll(&fds, 1, -1) > 0 && drain_signals(sh->signal_fd))
+			wait_for_children(sh);
+	}
+	// report the jobs that didn't succeed
+	for(i = 0; i < num_jobs; i++){
+		int status = jobs->batch_status[i];
+		if(WIFEXITED(status) && WEXITSTATUS(status) == 0)
+			continue;
+		failed++;
+		if(status == -1)
+			printf("parallel: line %ld could not be parsed\n", lines[i]);
+		else if(WIFEXITED(status))
+			printf("parallel: line %ld exited with status %d\n", lines[i], WEXITSTATUS(status));
+		else
+			printf("parallel: line %ld was terminated by signal %d\n", lines[i], WTERMSIG(status));
+	}
+	free(lines);
+	free(jobs->batch_status);
+	jobs->batch_status = NULL;
+	if(reader == &own)
+		reader_free(reader);
+	arena_free(&arena);
+	free(expanded.data);
+	if(fd != 0)
+		close(fd);
+	return failed > 0;
+}
+
+/******************************************************************************
+ * int builtin_jobs(struct shell *, char **)
+ * 
+ * Lists the jobs that are running or stopped. jobs --stats instead
+ * prints percentiles of what the jobs finished this session used.
+ *****************************************************************************/
+int builtin_jobs(struct shell * sh, char ** commands){
+	struct job_table * jobs = &sh->jobs;
+	struct job_stats * stats = &sh->stats;
+	int i = 0;
+	int j;
+	if(commands[1] != NULL && strcmp(commands[1], "--stats") == 0){
+		double * values;
+		printf("%d jobs finished\n", stats->count);
+		if(stats->count == 0)
+			return 0;
+		values = malloc(stats->count * sizeof(double));
+		printf("%-10s %12s %12s %12s %12s\n", "", "p50", "p90", "p99", "max");
+		for(i = 0; i < stats->count; i++)
+			values[i] = stats->samples[i].wall;
+		print_percentiles("wall (s)", values, stats->count);
+		for(i = 0; i < stats->count; i++)
+			values[i] = stats->samples[i].user;
+		print_percentiles("user (s)", values, stats->count);
+		for(i = 0; i < stats->count; i++)
+			values[i] = stats->samples[i].sys;
+		print_percentiles("sys (s)", values, stats->count);
+		for(i = 0; i < stats->count; i++)
+			values[i] = stats->samples[i].max_rss;
+		print_percentiles("rss (KB)", values, stats->count);
+		for(i = 0; i < stats->count; i++)
+			values[i] = stats->samples[i].switches;
+		print_percentiles("ctxsw", values, stats->count);
+		free(values);
+		return 0;
+	}
+	for(; i < jobs->capacity; i++){
+		struct job * job = &jobs->jobs[i];
+		if(!job->in_use)
+			continue;
+		printf("[%d] %s %.1fs", i + 1, job->stopped ? "stopped" : "running", seconds_since(&job->started));
+		for(j = 0; j < job->num_pids; j++)
+			printf(" %d", job->pids[j]);
+		printf("\n");
+	}
+	return 0;
+}
+
+/******************************************************************************
+ * int builtin_history(struct shell *, char **)
+ * 
+ * Lists the kept history with the numbers !N takes, or the last N lines
+ * with history N.
+ *****************************************************************************/
+int builtin_history(struct shell * sh, char ** commands){
+	struct history * history = &sh->history;
+	long first;
+	long n;
+	if(!sh->has_history)
+		return 0;
+	history_load(history);
+	first = history->count - history->capacity + 1;
+	if(commands[1] != NULL && history->count - atol(commands[1]) + 1 > first)
+		first = history->count - atol(commands[1]) + 1;
+	if(first < 1)
+		first = 1;
+	for(n = first; n <= history->count; n++)
+		printf("%5ld  %s\n", n, history_get(history, n));
+	return 0;
+}
+
+/******************************************************************************
+ * int builtin_output(struct shell *, char **)
+ * 
+ * Prints what a captured background job has written so far, the job named
+ * by its pid or %N. Once the job is done and its output has been printed
+ * the capture is dropped. With no job lists the captures that are kept.
+ *****************************************************************************/
+int builtin_output(struct shell * sh, char ** commands){
+	struct capture_table * table = &sh->captures;
+	struct capture * capture;
+	pid_t pid;
+	int i = 0;
+	// pick up whatever is waiting in the pipes first
+	drain_captures(table);
+	if(commands[1] == NULL){
+		for(; i < table->count; i++){
+			capture = &table->captures[i];
+			printf("%d %s %zu bytes", capture->pid, capture->fd >= 0 ? "open" : "done", capture->length);
+			if(capture->dropped > 0)
+				printf(" (%lu dropped)", capture->dropped);
+			printf("\n");
+		}
+		return 0;
+	}
+	if(commands[1][0] == '%'){
+		int slot = find_job(sh, "output", commands[1]);
+		if(slot < 0)
+			return 1;
+		pid = sh->jobs.jobs[slot].pids[0];
+	}
+	else{
+		pid = atoi(commands[1]);
+	}
+	for(; i < table->count && table->captures[i].pid != pid; i++)
+		;
+	if(i == table->count){
+		fprintf(stderr, "smallsh: output: no output captured for %s\n", commands[1]);
+		return 1;
+	}
+	// the ring may wrap around its end
+	capture = &table->captures[i];
+	if(capture->start + capture->length > table->ring_size){
+		fwrite(capture->ring + capture->start, 1, table->ring_size - capture->start, stdout);
+		fwrite(capture->ring, 1, capture->start + capture->length - table->ring_size, stdout);
+	}
+	else{
+		fwrite(capture->ring + capture->start, 1, capture->length, stdout);
+	}
+	if(capture->fd < 0)
+		capture_remove(table, i);
+	return 0;
+}
+
+/******************************************************************************
+ * int capture_open(struct capture_table *, int *)
+ * 
+ * Makes a pipe for a job to write its output to, and starts watching its
+ * read end. Sets the write end for the job and returns the new capture, or
+ * -1 if the pipe can't be made and the job should just write to our output.
+ *****************************************************************************/
+int capture_open(struct capture_table * table, int * write_fd){
+	struct epoll_event event = { 0 };
+	struct capture * capture;
+	int fds[2];
+	if(table->epoll_fd < 0)
+		table->epoll_fd = shell_fd(epoll_create1(EPOLL_CLOEXEC));
+	if(table->epoll_fd < 0 || pipe2(fds, O_CLOEXEC) < 0)
+		return -1;
+	// the read end stays open for as long as the job runs
+	fds[0] = shell_fd(fds[0]);
+	// we only ever read what is already there
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	event.events = EPOLLIN;
+	event.data.fd = fds[0];
+	epoll_ctl(table->epoll_fd, EPOLL_CTL_ADD, fds[0], &event);
+	if(table->count == table->capacity){
+		table->capacity = table->capacity ? 2 * table->capacity : 8;
+		table->captures = realloc(table->captures, table->capacity * sizeof(struct capture));
+		if(table->captures == NULL){
+			fprintf(stderr, "smallsh: out of memory\n");
+			exit(1);
+		}
+	}
+	capture = &table->captures[table->count];
+	capture->pid = 0;
+	capture->fd = fds[0];
+	capture->ring = malloc(table->ring_size);
+	capture->start = 0;
+	capture->length = 0;
+	capture->dropped = 0;
+	table->num_open++;
+	*write_fd = fds[1];
+	return table->count++;
+}
+
+/******************************************************************************
+ * void capture_remove(struct capture_table *, int)
+ * 
+ * Drops a capture, closing its pipe if it is still open. The last capture
+ * takes its place.
+ *****************************************************************************/
+void capture_remove(struct capture_table * table, int i){
+	struct capture * capture = &table->captures[i];
+	if(capture->fd >= 0){
+		// closing it takes it out of the epoll set too
+		close(capture->fd);
+		table->num_open--;
+	}
+	free(capture->ring);
+	table->captures[i] = table->captures[--table->count];
+}
+
+/******************************************************************************
+ * void capture_free(struct capture_table *)
+ * 
+ * Drops every capture and closes the epoll instance.
+ *****************************************************************************/
+void capture_free(struct capture_table * table){
+	while(table->count > 0)
+		capture_remove(table, table->count - 1);
+	free(table->captures);
+	if(table->epoll_fd >= 0)
+		close(table->epoll_fd);
+}
+
+/******************************************************************************
+ * int builtin_ulimit(struct shell *, char **)
+ * 
+ * Sets the resource limits of the jobs started from now on, not of the
+ * shell: ulimit [-c|-d|-f|-n|-s|-t|-u|-v VALUE] ... with the units bash
+ * uses, or unlimited. --cpus N and --mem BYTES cap every job in a cgroup
+ * of its own under SMALLSH_CGROUP, where 0 takes the cap off. An option
+ * without a value prints it, and no options prints everything that is set.
+ *****************************************************************************/
+int builtin_ulimit(struct shell * sh, char ** commands){
+	static const struct { char letter; int resource; rlim_t unit; const char * name; } options[] = {
+		{ 'c', RLIMIT_CORE, 1024, "core file size (KB)" },
+		{ 'd', RLIMIT_DATA, 1024, "data size (KB)" },
+		{ 'f', RLIMIT_FSIZE, 1024, "file size (KB)" },
+		{ 'n', RLIMIT_NOFILE, 1, "open files" },
+		{ 's', RLIMIT_STACK, 1024, "stack size (KB)" },
+		{ 't', RLIMIT_CPU, 1, "cpu time (s)" },
+		{ 'u', RLIMIT_NPROC, 1, "processes" },
+		{ 'v', RLIMIT_AS, 1024, "virtual memory (KB)" },
+	};
+	int num_options = sizeof(options) / sizeof(options[0]);
+	struct job_limits * limits = &sh->limits;
+	struct rlimit current;
+	rlim_t value;
+	double share;
+	int i = 1;
+	int j;
+	if(commands[1] == NULL){
+		for(j = 0; j < num_options; j++){
+			if(!limits->set[options[j].resource])
+				continue;
+			value = limits->value[options[j].resource];
+			if(value == RLIM_INFINITY)
+				printf("%-22s -%c unlimited\n", options[j].name, options[j].letter);
+			else
+				printf("%-22s -%c %llu\n", options[j].name, options[j].letter, (unsigned long long)(value / options[j].unit));
+		}
+		if(limits->cpus > 0)
+			printf("%-22s --cpus %g\n", "cpus", limits->cpus);
+		if(limits->memory > 0)
+			printf("%-22s --mem %lld\n", "memory (bytes)", limits->memory);
+		return 0;
+	}
+	for(; commands[i] != NULL; i++){
+		const char * option = commands[i];
+		const char * argument = commands[i + 1];
+		if(strcmp(option, "--cpus") == 0 || strcmp(option, "--mem") == 0){
+			int cpus = option[2] == 'c';
+			if(argument == NULL){
+				if(cpus)
+					printf("%g\n", limits->cpus);
+				else
+					printf("%lld\n", limits->memory);
+				return 0;
+			}
+			if(sh->opts.cgroup_root == NULL){
+				fprintf(stderr, "smallsh: ulimit: %s needs SMALLSH_CGROUP\n", option);
+				return 1;
+			}
+			// check the value before the cgroup is touched at all
+			if(cpus ? parse_cpus(argument, &share) < 0 :
+					parse_limit(argument, 1, &value) < 0 || (value != RLIM_INFINITY && value > LLONG_MAX)){
+				fprintf(stderr, "smallsh: ulimit: %s: bad value %s\n", option, argument);
+				return 1;
+			}
+			// let the job cgroups use the controller, if nobody did yet
+			cgroup_write(sh->opts.cgroup_root, "cgroup.subtree_control", cpus ? "+cpu" : "+memory");
+			if(cpus)
+				limits->cpus = share;
+			else
+				limits->memory = value == RLIM_INFINITY ? 0 : (long long)value;
+			i++;
+			continue;
+		}
+		for(j = 0; j < num_options; j++)
+			if(option[0] == '-' && option[1] == options[j].letter && option[2] == '\0')
+				break;
+		if(j == num_options){
+			fprintf(stderr, "smallsh: ulimit: usage: ulimit [-c|-d|-f|-n|-s|-t|-u|-v VALUE] [--cpus N] [--mem BYTES]\n");
+			return 2;
+		}
+		getrlimit(options[j].resource, &current);
+		if(argument == NULL){
+			// what the jobs get, ours when it wasn't set
+			value = limits->set[options[j].resource] ? limits->value[options[j].resource] : current.rlim_cur;
+			if(value == RLIM_INFINITY)
+				printf("unlimited\n");
+			else
+				printf("%llu\n", (unsigned long long)(value / options[j].unit));
+			return 0;
+		}
+		if(parse_limit(argument, options[j].unit, &value) < 0){
+			fprintf(stderr, "smallsh: ulimit: %s: bad value %s\n", option, argument);
+			return 1;
+		}
+		// a child can't raise its hard limit, so don't let it try
+		if(current.rlim_max != RLIM_INFINITY && (value == RLIM_INFINITY || value > current.rlim_max)){
+			fprintf(stderr, "smallsh: ulimit: %s: above the hard limit\n", option);
+			return 1;
+		}
+		limits->set[options[j].resource] = 1;
+		limits->value[options[j].resource] = value;
+		limits->any = 1;
+		i++;
+	}
+	return 0;
+}
+
+/******************************************************************************
+ * int parse_limit(const char *, rlim_t, rlim_t *)
+ * 
+ * Reads a limit given in units, with an optional K, M or G suffix of 1024s,
+ * or unlimited. Returns 0 on success and -1 if it isn't a number or is too
+ * big to be anything but unlimited.
+ *****************************************************************************/
+int parse_limit(const char * text, rlim_t unit, rlim_t * value){
+	char * end;
+	unsigned long long number;
+	unsigned long long scale = 1;
+	if(strcmp(text, "unlimited") == 0){
+		*value = RLIM_INFINITY;
+		return 0;
+	}
+	if(*text < '0' || *text > '9')
+		return -1;
+	errno = 0;
+	number = strtoull(text, &end, 10);
+	if(errno == ERANGE)
+		return -1;
+	if(*end == 'K' || *end == 'k')
+		scale = 1024, end++;
+	else if(*end == 'M' || *end == 'm')
+		scale = 1024 * 1024, end++;
+	else if(*end == 'G' || *end == 'g')
+		scale = 1024 * 1024 * 1024, end++;
+	if(*end != '\0')
+		return -1;
+	// the product has to fit, and stay below the value meaning unlimited
+	if(number > (RLIM_INFINITY - 1) / (scale * unit))
+		return -1;
+	*value = number * scale * unit;
+	return 0;
+}
+
+/******************************************************************************
+ * int parse_cpus(const char *, double *)
+ * 
+ * Reads the number of CPUs a job may use, which may be a fraction. It has to
+ * be 0 for no cap, or between the smallest quota cpu.max takes and the CPUs
+ * the machine has. Returns 0 on success and -1 otherwise.
+ *****************************************************************************/
+int parse_cpus(const char * text, double * cpus){
+	char * end;
+	if(*text < '0' || *text > '9')
+		return -1;
+	errno = 0;
+	*cpus = strtod(text, &end);
+	if(errno == ERANGE || *end != '\0')
+		return -1;
+	// the quota is in microseconds of a 100ms period, and at least 1ms
+	if(*cpus != 0 && (*cpus < 0.01 || *cpus > sysconf(_SC_NPROCESSORS_CONF)))
+		return -1;
+	return 0;
+}
+
+/******************************************************************************
+ * void apply_limits(struct job_limits *)
+ * 
+ * Runs in the child, sets both the soft and the hard limits the ulimit built
+ * in asked for so the job can't raise them again. Exits if one can't be set.
+ *****************************************************************************/
+void apply_limits(struct job_limits * limits){
+	struct rlimit limit;
+	int i = 0;
+	if(!limits->any)
+		return;
+	for(; i < RLIM_NLIMITS; i++){
+		if(!limits->set[i])
+			continue;
+		limit.rlim_cur = limits->value[i];
+		limit.rlim_max = limits->value[i];
+		if(setrlimit(i, &limit) < 0){
+			fprintf(stderr, "smallsh: cannot set a resource limit: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+}
+
+/******************************************************************************
+ * char * job_cgroup(struct shell *, int *)
+ * 
+ * Makes a cgroup for a job under SMALLSH_CGROUP with the CPU and memory caps
+ * the ulimit built in set, and opens it for fork_into. Returns its path,
+ * which the job owns and removes when it is done, or NULL with the error
+ * printed if the cgroup can't be made with its caps.
+ *****************************************************************************/
+char * job_cgroup(struct shell * sh, int * fd){
+	struct job_limits * limits = &sh->limits;
+	char * path = malloc(strlen(sh->opts.cgroup_root) + 64);
+	char value[64];
+	const char * failed = NULL;
+	sprintf(path, "%s/smallsh-%d-%lu", sh->opts.cgroup_root, (int)getpid(), limits->num_cgroups++);
+	if(mkdir(path, 0755) < 0){
+		fprintf(stderr, "smallsh: cannot make cgroup %s: %s\n", path, strerror(errno));
+		free(path);
+		return NULL;
+	}
+	if(limits->cpus > 0){
+		// a quota of this many microseconds every 100 milliseconds
+		snprintf(value, sizeof(value), "%lld 100000", (long long)(limits->cpus * 100000));
+		if(cgroup_write(path, "cpu.max", value) < 0)
+			failed = "cpu.max";
+	}
+	if(failed == NULL && limits->memory > 0){
+		snprintf(value, sizeof(value), "%lld", limits->memory);
+		if(cgroup_write(path, "memory.max", value) < 0)
+			failed = "memory.max";
+	}
+	if(failed == NULL)
+		*fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(failed != NULL || *fd < 0){
+		fprintf(stderr, "smallsh: cgroup %s: cannot set %s: %s\n", path, failed ? failed : "up", strerror(errno));
+		rmdir(path);
+		free(path);
+		return NULL;
+	}
+	return path;
+}
+
+/******************************************************************************
+ * int cgroup_write(const char *, const char *, const char *)
+ * 
+ * Writes the value to one of the cgroup's files. Returns 0 on success and
+ * -1 otherwise.
+ *****************************************************************************/
+int cgroup_write(const char * cgroup, const char * file, const char * value){
+	char path[PATH_MAX];
+	int fd;
+	int result;
+	snprintf(path, sizeof(path), "%s/%s", cgroup, file);
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if(fd < 0)
+		return -1;
+	result = write(fd, value, strlen(value)) < 0 ? -1 : 0;
+	close(fd);
+	return result;
+}
+
+/******************************************************************************
+ * pid_t fork_into(int)
+ * 
+ * Forks, with the child starting out in the cgroup whose directory is open
+ * on the descriptor, if it isn't -1. That is done by clone3 with
+ * CLONE_INTO_CGROUP so the child never runs outside of it. Where clone3
+ * can't do that the child moves itself over before it goes on, and exits if
+ * it can't. Returns what fork returns.
+ *****************************************************************************/
+pid_t fork_into(int cgroup_fd){
+	pid_t pid;
+	if(cgroup_fd < 0)
+		return fork();
+#ifdef CLONE_INTO_CGROUP
+	struct clone_args args;
+	memset(&args, 0, sizeof(args));
+	args.flags = CLONE_INTO_CGROUP;
+	args.exit_signal = SIGCHLD;
+	args.cgroup = cgroup_fd;
+	pid = syscall(SYS_clone3, &args, sizeof(args));
+	if(pid >= 0)
+		return pid;
+#endif
+	pid = fork();
+	if(pid == 0){
+		int fd = openat(cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+		if(fd < 0 || write(fd, "0", 1) < 0){
+			fprintf(stderr, "smallsh: cannot join the job's cgroup: %s\n", strerror(errno));
+			_exit(1);
+		}
+		close(fd);
+	}
+	return pid;
+}
+
+/******************************************************************************
+ * int parse_cpu_list(const char *, cpu_set_t *)
+ * 
+ * Reads a list of CPUs and ranges of them like 0-3,8,10-11, the format the
+ * kernel uses too. Returns 0 on success and -1 if it isn't one.
+ *****************************************************************************/
+int parse_cpu_list(const char * text, cpu_set_t * cpus){
+	char * end;
+	long first;
+	long last;
+	CPU_ZERO(cpus);
+	while(*text >= '0' && *text <= '9'){
+		first = strtol(text, &end, 10);
+		last = first;
+		if(*end == '-'){
+			text = end + 1;
+			if(*text < '0' || *text > '9')
+				return -1;
+			last = strtol(text, &end, 10);
+		}
+		if(last < first || last >= CPU_SETSIZE)
+			return -1;
+		for(; first <= last; first++)
+			CPU_SET(first, cpus);
+		text = end;
+		if(*text != ',')
+			break;
+		text++;
+	}
+	return *text == '\0' && CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
+/******************************************************************************
+ * void placement_load(struct placement *)
+ * 
+ * Remembers the CPUs and memory policy the shell started with, and reads
+ * which CPUs every NUMA node has from sysfs. A machine without nodes there
+ * gets no memory policies.
+ *****************************************************************************/
+void placement_load(struct placement * placement){
+	char path[64];
+	char line[4096];
+	FILE * file;
+	int node = 0;
+	int missing = 0;
+	if(placement->loaded)
+		return;
+	placement->loaded = 1;
+	sched_getaffinity(0, sizeof(cpu_set_t), &placement->allowed);
+	if(syscall(SYS_get_mempolicy, &placement->saved_mode, placement->saved_nodes, MAX_NODES, NULL, 0) < 0)
+		placement->saved_mode = MPOL_DEFAULT;
+	// node numbers can have gaps, so give up after a run of missing ones
+	for(; node < MAX_NODES && missing < 64; node++){
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		file = fopen(path, "re");
+		if(file == NULL){
+			missing++;
+			continue;
+		}
+		missing = 0;
+		if(fgets(line, sizeof(line), file) != NULL){
+			line[strcspn(line, "\n")] = '\0';
+			placement->node_cpus = realloc(placement->node_cpus, (placement->num_nodes + 1) * sizeof(cpu_set_t));
+			placement->node_ids = realloc(placement->node_ids, (placement->num_nodes + 1) * sizeof(int));
+			// a node with memory but no CPUs has nothing to run jobs on
+			if(parse_cpu_list(line, &placement->node_cpus[placement->num_nodes]) == 0){
+				CPU_AND(&placement->node_cpus[placement->num_nodes], &placement->node_cpus[placement->num_nodes], &placement->allowed);
+				if(CPU_COUNT(&placement->node_cpus[placement->num_nodes]) > 0)
+					placement->node_ids[placement->num_nodes++] = node;
+			}
+		}
+		fclose(file);
+	}
+}
+
+/******************************************************************************
+ * cpu_set_t * next_placement(struct shell *, cpu_set_t *)
+ * 
+ * Picks where the next background job goes with SMALLSH_PIN: the next CPU
+ * we may use, or all the CPUs of the next NUMA node. Fills in the set and
+ * returns it.
+ *****************************************************************************/
+cpu_set_t * next_placement(struct shell * sh, cpu_set_t * cpus){
+	struct placement * placement = &sh->placement;
+	int count;
+	int cpu = 0;
+	int n;
+	placement_load(placement);
+	if(sh->opts.pin == PIN_NODE && placement->num_nodes > 0){
+		*cpus = placement->node_cpus[placement->next++ % placement->num_nodes];
+		return cpus;
+	}
+	// the nth CPU we are allowed on
+	count = CPU_COUNT(&placement->allowed);
+	n = count > 0 ? placement->next++ % count : 0;
+	for(; cpu < CPU_SETSIZE; cpu++)
+		if(CPU_ISSET(cpu, &placement->allowed) && n-- == 0)
+			break;
+	CPU_ZERO(cpus);
+	CPU_SET(cpu, cpus);
+	return cpus;
+}
+
+/******************************************************************************
+ * int place_shell(struct shell *, cpu_set_t *)
+ * 
+ * Moves the shell onto the CPUs, preferring memory on their NUMA nodes, so
+ * that the children it starts next inherit both. NULL moves it back to
+ * where it started. Only failing to set the CPUs is an error, a memory
+ * policy is a hint. Returns 0 on success and -1 otherwise.
+ *****************************************************************************/
+int place_shell(struct shell * sh, cpu_set_t * cpus){
+	struct placement * placement = &sh->placement;
+	unsigned long nodes[MAX_NODES / (8 * sizeof(unsigned long))];
+	cpu_set_t shared;
+	int num_nodes = 0;
+	int node;
+	int i = 0;
+	placement_load(placement);
+	if(cpus == NULL){
+		sched_setaffinity(0, sizeof(cpu_set_t), &placement->allowed);
+		if(placement->num_nodes > 1)
+			syscall(SYS_set_mempolicy, placement->saved_mode, placement->saved_nodes, MAX_NODES + 1);
+		return 0;
+	}
+	if(sched_setaffinity(0, sizeof(cpu_set_t), cpus) < 0)
+		return -1;
+	if(placement->num_nodes < 2)
+		return 0;
+	memset(nodes, 0, sizeof(nodes));
+	for(; i < placement->num_nodes; i++){
+		CPU_AND(&shared, cpus, &placement->node_cpus[i]);
+		if(CPU_COUNT(&shared) == 0)
+			continue;
+		node = placement->node_ids[i];
+		nodes[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+		num_nodes++;
+	}
+	// older kernels can only prefer a single node
+	if(num_nodes == 1)
+		syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodes, MAX_NODES + 1);
+	else if(num_nodes > 1)
+		syscall(SYS_set_mempolicy, MPOL_PREFERRED_MANY, nodes, MAX_NODES + 1);
+	return 0;
+}
+
+/******************************************************************************
+ * void glob_pipeline(struct shell *, struct pipeline *)
+ * 
+ * Replaces every argument with *, ? or [ in it by the paths it matches, in
+ * sorted order, the way sh does. A pattern that matches nothing is passed on
+ * as it is, and names starting with a dot are only matched by patterns that
+ * start with one. Redirect targets are left alone. The new args live in the
+ * line arena.
+ *****************************************************************************/
+void glob_pipeline(struct shell * sh, struct pipeline * pipeline){
+	struct glob_matches matches;
+	struct command * cmd;
+	char path[PATH_MAX];
+	char ** argv;
+	int capacity;
+	int argc;
+	int i = 0;
+	int j;
+	for(; i < pipeline->num_cmds; i++){
+		cmd = &pipeline->cmds[i];
+		for(j = 0; j < cmd->argc && !has_glob(cmd->argv[j]); j++)
+			;
+		// most commands have nothing to glob
+		if(j == cmd->argc)
+			continue;
+		capacity = cmd->argc + 16;
+		argv = arena_alloc(&sh->arena, (capacity + 1) * sizeof(char *));
+		argc = 0;
+		for(j = 0; j < cmd->argc; j++){
+			matches.count = 0;
+			matches.capacity = 0;
+			matches.paths = NULL;
+			if(has_glob(cmd->argv[j])){
+				// the search starts at the root for an absolute pattern
+				path[0] = '\0';
+				glob_walk(sh, path, 0, cmd->argv[j], &matches);
+				// with no matches there isn't even an array to sort
+				if(matches.count > 1)
+					qsort(matches.paths, matches.count, sizeof(char *), compare_strings);
+			}
+			if(matches.count == 0){
+				matches.paths = &cmd->argv[j];
+				matches.count = 1;
+			}
+			if(argc + matches.count > capacity){
+				// leave room for the null that ends the args
+				char ** bigger;
+				while(argc + matches.count > capacity)
+					capacity *= 2;
+				bigger = arena_alloc(&sh->arena, (capacity + 1) * sizeof(char *));
+				memcpy(bigger, argv, argc * sizeof(char *));
+				argv = bigger;
+			}
+			memcpy(argv + argc, matches.paths, matches.count * sizeof(char *));
+			argc += matches.count;
+		}
+		argv[argc] = NULL;
+		cmd->argv = argv;
+		cmd->argc = argc;
+	}
+}
+
+/******************************************************************************
+ * int has_glob(const char *)
+ * 
+ * Returns whether the word has any of the glob characters *, ? and [.
+ *****************************************************************************/
+int has_glob(const char * word){
+	return strpbrk(word, "*?[") != NULL;
+}
+
+/******************************************************************************
+ * void glob_walk(struct shell *, char *, size_t, const char *, struct glob_matches *)
+ * 
+ * Matches the rest of a pattern one path component at a time below the
+ * directory in path, whose length is given and which is empty for the
+ * current directory. Components without glob characters are taken as they
+ * are, the others are matched against the directory's cached listing. Adds
+ * the paths that exist to the matches.
+ *****************************************************************************/
+void glob_walk(struct shell * sh, char * path, size_t length, const char * rest, struct glob_matches * matches){
+	struct dir_listing * listing;
+	const char * slash;
+	size_t component;
+	struct stat info;
+	char pattern[NAME_MAX + 1];
+	char ** names;
+	int num_names = 0;
+	int i = 0;
+	// a slash at the start or several in a row stay in the path
+	while(*rest == '/'){
+		if(length + 1 >= PATH_MAX)
+			return;
+		path[length++] = '/';
+		path[length] = '\0';
+		rest++;
+	}
+	if(*rest == '\0'){
+		// the pattern was all used up, so this is a match if it is there
+		if(lstat(path, &info) < 0)
+			return;
+		if(matches->count == matches->capacity){
+			char ** bigger;
+			matches->capacity = matches->capacity ? 2 * matches->capacity : 16;
+			bigger = arena_alloc(&sh->arena, matches->capacity * sizeof(char *));
+			if(matches->count > 0)
+				memcpy(bigger, matches->paths, matches->count * sizeof(char *));
+			matches->paths = bigger;
+		}
+		matches->paths[matches->count++] = arena_strdup(&sh->arena, path);
+		return;
+	}
+	slash = strchr(rest, '/');
+	component = slash != NULL ? (size_t)(slash - rest) : strlen(rest);
+	if(component > NAME_MAX || length + component + 1 >= PATH_MAX)
+		return;
+	memcpy(pattern, rest, component);
+	pattern[component] = '\0';
+	if(!has_glob(pattern)){
+		memcpy(path + length, pattern, component + 1);
+		glob_walk(sh, path, length + component, rest + component, matches);
+		path[length] = '\0';
+		return;
+	}
+	listing = list_directory(&sh->dirs, length > 0 ? path : ".");
+	if(listing == NULL)
+		return;
+	// take the matching names out first, walking further down may replace
+	// the listing in the cache
+	names = arena_alloc(&sh->arena, (listing->count + 1) * sizeof(char *));
+	for(; i < listing->count; i++)
+		if(fnmatch(pattern, listing->names[i], FNM_PERIOD) == 0)
+			names[num_names++] = arena_strdup(&sh->arena, listing->names[i]);
+	for(i = 0; i < num_names; i++){
+		if(length + strlen(names[i]) + 1 >= PATH_MAX)
+			continue;
+		strcpy(path + length, names[i]);
+		glob_walk(sh, path, length + strlen(names[i]), rest + component, matches);
+		path[length] = '\0';
+	}
+}
+
+/******************************************************************************
+ * struct dir_listing * list_directory(struct dir_cache *, const char *)
+ * 
+ * Returns the sorted names in the directory, from the cache if the directory
+ * is still the same one with the same mtime, and reading it otherwise. A
+ * listing read in the same second the directory last changed is read again
+ * next time, as a change right after it could keep the mtime. Returns NULL
+ * if the directory can't be read.
+ *****************************************************************************/
+struct dir_listing * list_directory(struct dir_cache * cache, const char * path){
+	struct dir_listing * listing;
+	struct dirent * entry;
+	struct stat info;
+	struct timespec now;
+	DIR * dir;
+	int capacity;
+	int i = 0;
+	if(stat(path, &info) < 0 || !S_ISDIR(info.st_mode))
+		return NULL;
+	for(; i < DIR_CACHE_SIZE; i++){
+		listing = &cache->listings[i];
+		if(listing->path != NULL && !listing->racy && strcmp(listing->path, path) == 0 &&
+				listing->dev == info.st_dev && listing->ino == info.st_ino &&
+				listing->mtime.tv_sec == info.st_mtim.tv_sec && listing->mtime.tv_nsec == info.st_mtim.tv_nsec)
+			return listing;
+	}
+	dir = opendir(path);
+	if(dir == NULL)
+		return NULL;
+	// take over the stale listing of this directory, or the oldest one
+	for(i = 0; i < DIR_CACHE_SIZE && (cache->listings[i].path == NULL || strcmp(cache->listings[i].path, path) != 0); i++)
+		;
+	if(i == DIR_CACHE_SIZE){
+		i = cache->next;
+		cache->next = (cache->next + 1) % DIR_CACHE_SIZE;
+	}
+	listing = &cache->listings[i];
+	dir_listing_free(listing);
+	listing->path = strdup(path);
+	listing->dev = info.st_dev;
+	listing->ino = info.st_ino;
+	listing->mtime = info.st_mtim;
+	clock_gettime(CLOCK_REALTIME, &now);
+	listing->racy = now.tv_sec <= info.st_mtim.tv_sec;
+	capacity = 64;
+	listing->names = malloc(capacity * sizeof(char *));
+	while((entry = readdir(dir)) != NULL){
+		if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		if(listing->count == capacity){
+			capacity *= 2;
+			listing->names = realloc(listing->names, capacity * sizeof(char *));
+		}
+		listing->names[listing->count++] = strdup(entry->d_name);
+	}
+	closedir(dir);
+	qsort(listing->names, listing->count, sizeof(char *), compare_strings);
+	return listing;
+}
+
+/******************************************************************************
+ * void dir_listing_free(struct dir_listing *)
+ * 
+ * Frees a listing's names and empties it.
+ *****************************************************************************/
+void dir_listing_free(struct dir_listing * listing){
+	int i = 0;
+	for(; i < listing->count; i++)
+		free(listing->names[i]);
+	free(listing->names);
+	free(listing->path);
+	memset(listing, 0, sizeof(*listing));
+}
+
+/******************************************************************************
+ * int compare_strings(const void *, const void *)
+ * 
+ * Orders pointers to strings for qsort.
+ *****************************************************************************/
+int compare_strings(const void * a, const void * b){
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/******************************************************************************
+ * int event_begin(struct event_log *, const char *)
+ * 
+ * Starts an event record of the given kind, stamped with the monotonic
+ * clock and the shell's pid. Returns 0 and records nothing when there is no
+ * event log, so callers can skip building the rest of it.
+ *****************************************************************************/
+int event_begin(struct event_log * log, const char * kind){
+	struct timespec now;
+	if(log->fd < 0)
+		return 0;
+	// the clock is read in the vDSO, so this costs no system call either
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	event_printf(log, "{\"ts\":%ld.%06ld,\"shell\":%d,\"event\":\"%s\"",
+		(long)now.tv_sec, now.tv_nsec / 1000, log->shell, kind);
+	return 1;
+}
+
+/******************************************************************************
+ * void event_printf(struct event_log *, const char *, ...)
+ * 
+ * Appends formatted text to the record being built.
+ *****************************************************************************/
+void event_printf(struct event_log * log, const char * format, ...){
+	struct text_buffer * buffer = &log->buffer;
+	va_list args;
+	int length;
+	text_reserve(buffer, 128);
+	va_start(args, format);
+	length = vsnprintf(buffer->data + buffer->length, buffer->capacity - buffer->length, format, args);
+	va_end(args);
+	if(length < 0)
+		return;
+	if((size_t)length >= buffer->capacity - buffer->length){
+		// it didn't fit, make room and format it again
+		text_reserve(buffer, length + 1);
+		va_start(args, format);
+		vsnprintf(buffer->data + buffer->length, buffer->capacity - buffer->length, format, args);
+		va_end(args);
+	}
+	buffer->length += length;
+}
+
+/******************************************************************************
+ * void event_string(struct event_log *, const char *)
+ * 
+ * Appends the text as a quoted JSON string, escaping what JSON wants
+ * escaped.
+ *****************************************************************************/
+void event_string(struct event_log * log, const char * text){
+	const char * start = text;
+	text_append(&log->buffer, "\"", 1);
+	for(; *text != '\0'; text++){
+		unsigned char c = *text;
+		if(c >= 0x20 && c != '"' && c != '\\')
+			continue;
+		text_append(&log->buffer, start, text - start);
+		if(c == '"' || c == '\\')
+			event_printf(log, "\\%c", c);
+		else
+			event_printf(log, "\\u%04x", c);
+		start = text + 1;
+	}
+	text_append(&log->buffer, start, text - start);
+	text_append(&log->buffer, "\"", 1);
+}
+
+/******************************************************************************
+ * void event_end(struct event_log *)
+ * 
+ * Finishes the record being built and writes the buffered records out once
+ * there are EVENT_BUFFER bytes of them.
+ *****************************************************************************/
+void event_end(struct event_log * log){
+	text_append(&log->buffer, "}\n", 2);
+	if(log->buffer.length >= EVENT_BUFFER)
+		events_flush(log);
+}
+
+/******************************************************************************
+ * void events_flush(struct event_log *)
+ * 
+ * Writes out the buffered records, if there are any. The log is given up
+ * when it can't be written to anymore.
+ *****************************************************************************/
+void events_flush(struct event_log * log){
+	size_t written = 0;
+	ssize_t result;
+	while(written < log->buffer.length){
+		result = write(log->fd, log->buffer.data + written, log->buffer.length - written);
+		if(result < 0 && errno == EINTR)
+			continue;
+		if(result < 0){
+			fprintf(stderr, "smallsh: cannot write events: %s\n", strerror(errno));
+			log->fd = -1;
+			break;
+		}
+		written += result;
+	}
+	log->buffer.length = 0;
+}
+
+/******************************************************************************
+ * void event_spawn(struct shell *, int, struct pipeline *)
+ * 
+ * Records that the job in the slot was started, with the command and pid of
+ * every stage that did start.
+ *****************************************************************************/
+void event_spawn(struct shell * sh, int slot, struct pipeline * pipeline){
+	struct job * job = &sh->jobs.jobs[slot];
+	int i = 0;
+	if(!event_begin(&sh->events, "spawn"))
+		return;
+	event_printf(&sh->events, ",\"job\":%d,\"pgid\":%d,\"fg\":%s,\"pids\":[",
+		slot + 1, job->pgid, pipeline->fg ? "true" : "false");
+	for(; i < job->num_pids; i++)
+		event_printf(&sh->events, i > 0 ? ",%d" : "%d", job->pids[i]);
+	event_printf(&sh->events, "],\"commands\":[");
+	for(i = 0; i < pipeline->num_cmds; i++){
+		if(i > 0)
+			event_printf(&sh->events, ",");
+		event_string(&sh->events, pipeline->cmds[i].argv[0]);
+	}
+	event_printf(&sh->events, "]");
+	event_end(&sh->events);
+}
+
+/******************************************************************************
+ * void event_done(struct shell *, int)
+ * 
+ * Records that the job in the slot is done, as an exit with its code or as
+ * a signal with the signal that ended it, along with how long it ran and
+ * what it used.
+ *****************************************************************************/
+void event_done(struct shell * sh, int slot){
+	struct job * job = &sh->jobs.jobs[slot];
+	int signalled = WIFSIGNALED(job->status);
+	if(!event_begin(&sh->events, signalled ? "signal" : "exit"))
+		return;
+	event_printf(&sh->events, ",\"job\":%d,\"pgid\":%d,\"%s\":%d", slot + 1, job->pgid,
+		signalled ? "signal" : "code", signalled ? WTERMSIG(job->status) : WEXITSTATUS(job->status));
+	event_printf(&sh->events, ",\"duration\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss\":%ld",
+		job->usage.wall, job->usage.user, job->usage.sys, job->usage.max_rss);
+	event_end(&sh->events);
+}
+
+/******************************************************************************
+ * void event_redirect(struct shell *, struct command *, struct redirect *, int)
+ * 
+ * Records that a redirect of the command failed with the given errno.
+ *****************************************************************************/
+void event_redirect(struct shell * sh, struct command * cmd, struct redirect * redirect, int error){
+	if(!event_begin(&sh->events, "redirect"))
+		return;
+	event_printf(&sh->events, ",\"command\":");
+	event_string(&sh->events, cmd->argv[0]);
+	event_printf(&sh->events, ",\"fd\":%d", redirect->fd);
+	if(redirect->type == REDIRECT_FILE){
+		event_printf(&sh->events, ",\"file\":");
+		event_string(&sh->events, redirect->filename);
+	}
+	else if(redirect->type == REDIRECT_DUP){
+		event_printf(&sh->events, ",\"source\":%d", redirect->source);
+	}
+	event_printf(&sh->events, ",\"error\":");
+	event_string(&sh->events, strerror(error));
+	event_end(&sh->events);
+}
+
+/******************************************************************************
+ * int drain_captures(struct capture_table *)
+ * 
+ * Reads everything that is waiting in the capture pipes straight into their
+ * rings, overwriting the oldest bytes once a ring is full. A pipe whose
+ * writers are all gone is closed. Returns how many pipes had something.
+ *****************************************************************************/
+int drain_captures(struct capture_table * table){
+	struct epoll_event events[16];
+	struct capture * capture;
+	size_t tail;
+	ssize_t num_read;
+	int num_ready = 0;
+	int count;
+	int i;
+	int j;
+	if(table->num_open == 0)
+		return 0;
+	do{
+		count = epoll_wait(table->epoll_fd, events, 16, 0);
+		for(i = 0; i < count; i++){
+			for(j = 0; j < table->count && table->captures[j].fd != events[i].data.fd; j++)
+				;
+			if(j == table->count)
+				continue;
+			capture = &table->captures[j];
+			while(1){
+				// read into the free part of the ring up to its end
+				tail = (capture->start + capture->length) % table->ring_size;
+				num_read = read(capture->fd, capture->ring + tail, table->ring_size - tail);
+				if(num_read < 0 && errno == EINTR)
+					continue;
+				if(num_read < 0)
+					break;
+				if(num_read == 0){
+					close(capture->fd);
+					capture->fd = -1;
+					table->num_open--;
+					break;
+				}
+				capture->length += num_read;
+				if(capture->length > table->ring_size){
+					// the new bytes took the place of the oldest ones
+					capture->dropped += capture->length - table->ring_size;
+					capture->start = (capture->start + capture->length - table->ring_size) % table->ring_size;
+					capture->length = table->ring_size;
+				}
+			}
+		}
+		num_ready += count > 0 ? count : 0;
+	} while(count == 16);
+	return num_ready;
+}
+
+/******************************************************************************
+ * int wait_for_output(struct shell *)
+ * 
+ * Sleeps until a child changes state or a captured job writes something,
+ * and drains the capture pipes. Returns whether SIGCHLD was read off the
+ * signalfd, in which case the caller has to reap the children it didn't
+ * wait for itself.
+ *****************************************************************************/
+int wait_for_output(struct shell * sh){
+	struct pollfd fds[2] = { { 0 } };
+	fds[0].fd = sh->signal_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = sh->captures.epoll_fd;
+	fds[1].events = POLLIN;
+	if(poll(fds, 2, -1) < 0)
+		return 0;
+	if(fds[1].revents & POLLIN)
+		drain_captures(&sh->captures);
+	return (fds[0].revents & POLLIN) && drain_signals(sh->signal_fd);
+}
+
+/******************************************************************************
+ * int find_job(struct shell *, const char *, const char *)
+ * 
+ * Returns the slot of the job named by a job number, with or without a %,
+ * or of the current job if there is no name. Jobs of a parallel batch can't
+ * be picked. Prints an error for the built in and returns -1 if there is no
+ * such job.
+ *****************************************************************************/
+int find_job(struct shell * sh, const char * builtin, const char * name){
+	struct job_table * jobs = &sh->jobs;
+	int slot = jobs->current;
+	int i = 0;
+	if(name != NULL){
+		if(*name == '%')
+			name++;
+		slot = atoi(name) - 1;
+	}
+	else if(slot < 0 || slot >= jobs->capacity || !jobs->jobs[slot].in_use){
+		// the current job is gone, take the newest one left
+		slot = -1;
+		for(; i < jobs->capacity; i++)
+			if(jobs->jobs[i].in_use && jobs->jobs[i].batch_index < 0)
+				slot = i;
+	}
+	if(slot < 0 || slot >= jobs->capacity || !jobs->jobs[slot].in_use || jobs->jobs[slot].batch_index >= 0){
+		fprintf(stderr, "smallsh: %s: no such job\n", builtin);
+		return -1;
+	}
+	return slot;
+}
+
+/******************************************************************************
+ * int builtin_fg(struct shell *, char **)
+ * 
+ * Continues a job in the foreground, giving it the terminal, and waits for
+ * it like any foreground job. The shell's status becomes the job's.
+ *****************************************************************************/
+int builtin_fg(struct shell * sh, char ** commands){
+	int slot = find_job(sh, "fg", commands[1]);
+	struct job * job;
+	int take_terminal = sh->opts.terminal;
+	if(slot < 0){
+		sh->status = W_EXITCODE(1, 0);
+		return 1;
+	}
+	job = &sh->jobs.jobs[slot];
+	if(job->pgid == 0){
+		// not in a group of its own, so there is nothing to hand over
+		take_terminal = 0;
+	}
+	else{
+		if(take_terminal)
+			tcsetpgrp(0, job->pgid);
+		kill(-job->pgid, SIGCONT);
+	}
+	job->stopped = 0;
+	wait_job(sh, slot, take_terminal);
+	return 0;
+}
+
+/******************************************************************************
+ * int builtin_bg(struct shell *, char **)
+ * 
+ * Continues a stopped job in the background.
+ *****************************************************************************/
+int builtin_bg(struct shell * sh, char ** commands){
+	int slot = find_job(sh, "bg", commands[1]);
+	struct job * job;
+	if(slot < 0)
+		return 1;
+	job = &sh->jobs.jobs[slot];
+	if(job->pgid == 0){
+		fprintf(stderr, "smallsh: bg: job %d has no process group\n", slot + 1);
+		return 1;
+	}
+	kill(-job->pgid, SIGCONT);
+	job->stopped = 0;
+	printf("Job %d continued in the background\n", slot + 1);
+	return 0;
+}
+
+/******************************************************************************
+ * int builtin_wait(struct shell *, char **)
+ * 
+ * Waits for background jobs: the ones named by pid or %N, or all of them,
+ * or with -n only the first of them to finish. A pid stands for the whole
+ * job it belongs to. The children are reaped as usual while we sleep on the
+ * signalfd, so nothing spins. -t SECONDS is the longest we sleep in total.
+ * Returns the exit code of the last job named, or of the job that finished
+ * with -n, 124 if the time ran out and 127 if a job isn't ours. A job
+ * whose processes can't be waited for any more is counted done with 127.
+ *****************************************************************************/
+int builtin_wait(struct shell * sh, char ** commands){
+	struct job_table * jobs = &sh->jobs;
+	struct pollfd fds[2] = { { 0 } };
+	struct timespec started;
+	double timeout = -1;
+	int any = 0;
+	int num_targets = 0;
+	int * targets;
+	int code = 0;
+	int remaining;
+	int i = 1;
+	int j;
+	for(; commands[i] != NULL && commands[i][0] == '-'; i++){
+		if(strcmp(commands[i], "-n") == 0){
+			any = 1;
+		}
+		else if(strcmp(commands[i], "-t") == 0 && commands[i + 1] != NULL){
+			timeout = atof(commands[++i]);
+		}
+		else{
+			fprintf(stderr, "smallsh: wait: usage: wait [-n] [-t SECONDS] [PID | %%N ...]\n");
+			return 2;
+		}
+	}
+	// the jobs to wait for, every one that isn't stopped when none are named
+	for(j = i; commands[j] != NULL; j++)
+		;
+	targets = arena_alloc(&sh->arena, (jobs->capacity + j - i + 1) * sizeof(int));
+	for(; commands[i] != NULL; i++){
+		int slot = -1;
+		if(commands[i][0] == '%'){
+			slot = find_job(sh, "wait", commands[i]);
+			if(slot < 0)
+				return 127;
+		}
+		else{
+			int pos = pid_index_find(jobs, atoi(commands[i]));
+			if(pos >= 0)
+				slot = jobs->index[pos].job;
+			if(slot < 0 || jobs->jobs[slot].batch_index >= 0){
+				fprintf(stderr, "smallsh: wait: pid %s is not a child of this shell\n", commands[i]);
+				return 127;
+			}
+		}
+		targets[num_targets++] = slot;
+	}
+	if(num_targets == 0){
+		for(j = 0; j < jobs->capacity; j++)
+			if(jobs->jobs[j].in_use && jobs->jobs[j].batch_index < 0 && !jobs->jobs[j].stopped)
+				targets[num_targets++] = j;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	while(num_targets > 0){
+		// reap first, anything that exits after this wakes up the poll
+		drain_signals(sh->signal_fd);
+		wait_for_children(sh);
+		for(j = 0; j < num_targets; j++){
+			struct job * job = &jobs->jobs[targets[j]];
+			int k = 0;
+			// a process that isn't our child will never be reaped, so its
+			// job is done as far as we can tell
+			for(; job->in_use && k < job->num_pids; k++){
+				siginfo_t info;
+				if(waitid(P_PID, job->pids[k], &info, WEXITED | WSTOPPED | WCONTINUED | WNOHANG | WNOWAIT) < 0 && errno == ECHILD)
+					job_reaped(jobs, job->pids[k], W_EXITCODE(127, 0), NULL);
+			}
+			if(job->in_use)
+				continue;
+			// this one is done, so take it off the list
+			code = exit_code(jobs->jobs[targets[j]].status);
+			targets[j--] = targets[--num_targets];
+			if(any)
+				return code;
+		}
+		if(num_targets == 0)
+			break;
+		remaining = -1;
+		if(timeout >= 0){
+			remaining = (timeout - seconds_since(&started)) * 1000;
+			if(remaining <= 0)
+				return 124;
+		}
+		// captured jobs may need their output read before they can exit
+		fds[0].fd = sh->signal_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = sh->captures.epoll_fd;
+		fds[1].events = POLLIN;
+		if(poll(fds, sh->captures.num_open > 0 ? 2 : 1, remaining) < 0 && errno != EINTR){
+			fprintf(stderr, "smallsh: wait: poll failed\n");
+			return 1;
+		}
+		if(fds[1].revents & POLLIN)
+			drain_captures(&sh->captures);
+	}
+	return code;
+}
+
+/******************************************************************************
+ * int exit_code(int)
+ * 
+ * Turns a wait status into the exit code $? shows, 128 plus the signal for
+ * a process that was killed.
+ *****************************************************************************/
+int exit_code(int status){
+	if(WIFEXITED(status))
+		return WEXITSTATUS(status);
+	return 128 + WTERMSIG(status);
+}
+
+/******************************************************************************
+ * int compare_doubles(const void *, const void *)
+ * 
+ * qsort comparison of two doubles.
+ *****************************************************************************/
+int compare_doubles(const void * a, const void * b){
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/******************************************************************************
+ * void print_percentiles(const char *, double *, int)
+ * 
+ * Sorts the values and prints their 50th, 90th and 99th percentiles (nearest
+ * rank) and their maximum on one row.
+ *****************************************************************************/
+void print_percentiles(const char * label, double * values, int count){
+	int ranks[3] = { 50, 90, 99 };
+	int i = 0;
+	qsort(values, count, sizeof(double), compare_doubles);
+	printf("%-10s", label);
+	for(; i < 3; i++){
+		int rank = (ranks[i] * count + 99) / 100;
+		printf(" %12.4g", values[rank > 0 ? rank - 1 : 0]);
+	}
+	printf(" %12.4g\n", values[count - 1]);
+}
+
+/******************************************************************************
+ * int evaluate_test(int, char **)
+ * 
+ * Evaluates a test expression of up to three words, optionally negated with
+ * a leading !. Supports the common file tests, -z and -n, string = and !=,
+ * and the integer comparisons.
+ *****************************************************************************/
+int evaluate_test(int argc, char ** args){
+	struct stat info;
+	if(argc > 0 && strcmp(args[0], "!") == 0){
+		int result = evaluate_test(argc - 1, args + 1);
+		return result == 2 ? 2 : !result;
+	}
+	if(argc == 0)
+		return 1;
+	if(argc == 1)
+		return args[0][0] == '\0';
+	if(argc == 2){
+		char * op = args[0];
+		char * arg = args[1];
+		if(strcmp(op, "-z") == 0)
+			return arg[0] != '\0';
+		if(strcmp(op, "-n") == 0)
+			return arg[0] == '\0';
+		if(strcmp(op, "-r") == 0)
+			return access(arg, R_OK) != 0;
+		if(strcmp(op, "-w") == 0)
+			return access(arg, W_OK) != 0;
+		if(strcmp(op, "-x") == 0)
+			return access(arg, X_OK) != 0;
+		if(strcmp(op, "-L") == 0 || strcmp(op, "-h") == 0)
+			return lstat(arg, &info) != 0 || !S_ISLNK(info.st_mode);
+		if(stat(arg, &info) != 0){
+			if(strcmp(op, "-e") == 0 || strcmp(op, "-f") == 0 || strcmp(op, "-d") == 0 || strcmp(op, "-s") == 0)
+				return 1;
+		}
+		else if(strcmp(op, "-e") == 0)
+			return 0;
+		else if(strcmp(op, "-f") == 0)
+			return !S_ISREG(info.st_mode);
+		else if(strcmp(op, "-d") == 0)
+			return !S_ISDIR(info.st_mode);
+		else if(strcmp(op, "-s") == 0)
+			return info.st_size == 0;
+		fprintf(stderr, "smallsh: test: unknown operator %s\n", op);
+		return 2;
+	}
+	if(argc == 3){
+		char * op = args[1];
+		long left;
+		long right;
+		char * end;
+		if(strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+			return strcmp(args[0], args[2]) != 0;
+		if(strcmp(op, "!=") == 0)
+			return strcmp(args[0], args[2]) == 0;
+		left = strtol(args[0], &end, 10);
+		if(*args[0] == '\0' || *end != '\0'){
+			fprintf(stderr, "smallsh: test: %s: integer expected\n", args[0]);
+			return 2;
+		}
+		right = strtol(args[2], &end, 10);
+		if(*args[2] == '\0' || *end != '\0'){
+			fprintf(stderr, "smallsh: test: %s: integer expected\n", args[2]);
+			return 2;
+		}
+		if(strcmp(op, "-eq") == 0)
+			return !(left == right);
+		if(strcmp(op, "-ne") == 0)
+			return !(left != right);
+		if(strcmp(op, "-lt") == 0)
+			return !(left < right);
+		if(strcmp(op, "-le") == 0)
+			return !(left <= right);
+		if(strcmp(op, "-gt") == 0)
+			return !(left > right);
+		if(strcmp(op, "-ge") == 0)
+			return !(left >= right);
+		fprintf(stderr, "smallsh: test: unknown operator %s\n", op);
+		return 2;
+	}
+	fprintf(stderr, "smallsh: test: too many arguments\n");
+	return 2;
+}
+
+/******************************************************************************
+ * void history_init(struct history *, struct shell_options *)
+ * 
+ * Sets up an empty history and opens the history file for appending. Only
+ * the file's size is looked at here, its lines are read by history_load.
+ *****************************************************************************/
+void history_init(struct history * history, struct shell_options * opts){
+	history->capacity = opts->history_size;
+	history->ring = calloc(history->capacity, sizeof(char *));
+	history->count = 0;
+	history->fd = -1;
+	history->file_start = 0;
+	history->loaded = 1;
+	if(opts->history_file == NULL)
+		return;
+	history->fd = shell_fd(open(opts->history_file, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600));
+	if(history->fd < 0){
+		fprintf(stderr, "smallsh: history: %s: %s\n", opts->history_file, strerror(errno));
+		return;
+	}
+	history->file_start = lseek(history->fd, 0, SEEK_END);
+	history->loaded = history->file_start <= 0;
+}
+
+/******************************************************************************
+ * void history_load(struct history *)
+ * 
+ * Reads the lines the file had before this session and puts the last of
+ * them in front of this session's lines, renumbering everything. The file is
+ * mapped, counted once and only the lines that fit in the ring are copied.
+ *****************************************************************************/
+void history_load(struct history * history){
+	struct history loaded;
+	char * data;
+	char * cursor;
+	char * end;
+	char * newline;
+	long total = 0;
+	long skip;
+	long i;
+	if(history->loaded)
+		return;
+	history->loaded = 1;
+	loaded = *history;
+	data = mmap(NULL, history->file_start, PROT_READ, MAP_PRIVATE, history->fd, 0);
+	if(data == MAP_FAILED)
+		return;
+	end = data + history->file_start;
+	for(cursor = data; cursor < end; total++){
+		newline = memchr(cursor, '\n', end - cursor);
+		cursor = newline != NULL ? newline + 1 : end;
+	}
+	// start over with the old lines, then move this session's ones after them
+	loaded.ring = calloc(history->capacity, sizeof(char *));
+	loaded.count = 0;
+	skip = total - history->capacity;
+	for(cursor = data; cursor < end; skip--){
+		newline = memchr(cursor, '\n', end - cursor);
+		if(newline == NULL)
+			newline = end;
+		if(skip < 0){
+			char * line = malloc(newline - cursor + 1);
+			memcpy(line, cursor, newline - cursor);
+			line[newline - cursor] = '\0';
+			history_push(&loaded, line);
+		}
+		else{
+			loaded.count++;
+		}
+		cursor = newline + 1;
+	}
+	munmap(data, history->file_start);
+	for(i = history->count - history->capacity; i < history->count; i++){
+		if(i < 0)
+			continue;
+		history_push(&loaded, history->ring[i % history->capacity]);
+		history->ring[i % history->capacity] = NULL;
+	}
+	free(history->ring);
+	*history = loaded;
+}
+
+/******************************************************************************
+ * void history_push(struct history *, char *)
+ * 
+ * Puts a malloc'd line in the ring as the newest entry, dropping the oldest
+ * one if the ring is full.
+ *****************************************************************************/
+void history_push(struct history * history, char * line){
+	char ** slot = &history->ring[history->count % history->capacity];
+	free(*slot);
+	*slot = line;
+	history->count++;
+}
+
+/******************************************************************************
+ * void history_add(struct history *, const char *)
+ * 
+ * Remembers a line that is about to run and appends it to the history file
+ * with one write, so the file is never rewritten. Blank lines are skipped.
+ *****************************************************************************/
+void history_add(struct history * history, const char * line){
+	const char * c = line;
+	struct iovec parts[2];
+	size_t length = strlen(line);
+	while(*c == ' ' || *c == '\t')
+		c++;
+	if(*c == '\0')
+		return;
+	history_push(history, strdup(line));
+	if(history->fd < 0)
+		return;
+	parts[0].iov_base = (void *)line;
+	parts[0].iov_len = length;
+	parts[1].iov_base = "\n";
+	parts[1].iov_len = 1;
+	// O_APPEND makes the line land whole at the end, even with other shells
+	// writing to the same file
+	if(writev(history->fd, parts, 2) < 0)
+		fprintf(stderr, "smallsh: history: %s\n", strerror(errno));
+}
+
+/******************************************************************************
+ * const char * history_get(struct history *, long)
+ * 
+ * Returns history entry n, counting from 1, or NULL if it isn't kept.
+ *****************************************************************************/
+const char * history_get(struct history * history, long n){
+	history_load(history);
+	if(n < 1 || n > history->count || n <= history->count - history->capacity)
+		return NULL;
+	return history->ring[(n - 1) % history->capacity];
+}
+
+/******************************************************************************
+ * void history_free(struct history *)
+ * 
+ * Frees the history and closes its file.
+ *****************************************************************************/
+void history_free(struct history * history){
+	int i = 0;
+	for(; i < history->capacity; i++)
+		free(history->ring[i]);
+	free(history->ring);
+	history->ring = NULL;
+	if(history->fd >= 0)
+		close(history->fd);
+	history->fd = -1;
+}
+
+/******************************************************************************
+ * char * expand_history(struct shell *, char *)
+ * 
+ * Replaces !! with the last line and !N with line N. Lines without either
+ * are returned as they are. An expanded line is built in the arena and
+ * echoed, like bash does. Returns NULL with an error printed if a line isn't
+ * in the history.
+ *****************************************************************************/
+char * expand_history(struct shell * sh, char * line){
+	struct history * history = &sh->history;
+	const char * entry;
+	char * expanded = NULL;
+	char * c;
+	char * end;
+	size_t length = 0;
+	size_t entry_length;
+	long n;
+	int pass = 0;
+	if(strchr(line, '!') == NULL)
+		return line;
+	history_load(history);
+	// measure the expanded line first, then write it
+	for(; pass < 2; pass++){
+		length = 0;
+		for(c = line; *c != '\0'; c++){
+			entry = NULL;
+			end = c + 1;
+			if(c[0] == '!' && c[1] == '!'){
+				entry = history_get(history, history->count);
+				end = c + 2;
+			}
+			else if(c[0] == '!' && c[1] >= '0' && c[1] <= '9'){
+				n = strtol(c + 1, &end, 10);
+				entry = history_get(history, n);
+			}
+			else{
+				if(expanded != NULL)
+					expanded[length] = *c;
+				length++;
+				continue;
+			}
+			if(entry == NULL){
+				fprintf(stderr, "smallsh: %.*s: event not found\n", (int)(end - c), c);
+				return NULL;
+			}
+			entry_length = strlen(entry);
+			if(expanded != NULL)
+				memcpy(expanded + length, entry, entry_length);
+			length += entry_length;
+			c = end - 1;
+		}
+		if(expanded == NULL)
+			expanded = arena_alloc(&sh->arena, length + 1);
+	}
+	expanded[length] = '\0';
+	if(strcmp(expanded, line) != 0){
+		printf("%s\n", expanded);
+		fflush(stdout);
+	}
+	return expanded;
+}
+
+/******************************************************************************
+ * char * expand_variables(struct shell *, struct text_buffer *, char *)
+ * 
+ * Expands $$, $? and $NAME or ${NAME} in one pass over the word, copying
+ * the text between them and the values into the buffer, which only grows
+ * when a word needs more than any word before it. $(COMMAND) is replaced by
+ * what the command prints. Words without a $ are returned as they are. $
+ * followed by anything else stays a $. Returns the expanded word, which
+ * lives in the buffer until it is used again, or NULL if a $( isn't closed.
+ *****************************************************************************/
+char * expand_variables(struct shell * sh, struct text_buffer * out, char * line){
+	char * c = strchr(line, '$');
+	char * copied = line;
+	char * name;
+	char * value;
+	char number[24];
+	int braced;
+	if(c == NULL)
+		return line;
+	out->length = 0;
+	while(c != NULL){
+		// everything up to the $ goes in as it is
+		text_append(out, copied, c - copied);
+		copied = c + 1;
+		if(c[1] == '$' || c[1] == '?'){
+			if(c[1] == '$')
+				snprintf(number, sizeof(number), "%d", (int)getpid());
+			else
+				snprintf(number, sizeof(number), "%d", exit_code(sh->status));
+			text_append(out, number, strlen(number));
+			copied = c + 2;
+		}
+		else if((c[1] >= '1' && c[1] <= '9') || c[1] == '#' || c[1] == '@'){
+			// the arguments of the function that is running
+			if(c[1] == '#'){
+				snprintf(number, sizeof(number), "%d", sh->num_args);
+				text_append(out, number, strlen(number));
+			}
+			else if(c[1] == '@'){
+				int i = 1;
+				for(; i <= sh->num_args; i++){
+					if(i > 1)
+						text_append(out, " ", 1);
+					text_append(out, sh->args[i], strlen(sh->args[i]));
+				}
+			}
+			else if(c[1] - '0' <= sh->num_args){
+				text_append(out, sh->args[c[1] - '0'], strlen(sh->args[c[1] - '0']));
+			}
+			copied = c + 2;
+		}
+		else if(c[1] == '('){
+			char * end = substitution_end(c);
+			if(end == NULL){
+				fprintf(stderr, "smallsh: missing ) after $(\n");
+				return NULL;
+			}
+			substitute(sh, out, c + 2, end - c - 2);
+			copied = end + 1;
+		}
+		else{
+			braced = c[1] == '{';
+			name = c + 1 + braced;
+			value = name;
+			if((*value >= 'A' && *value <= 'Z') || (*value >= 'a' && *value <= 'z') || *value == '_'){
+				while((*value >= 'A' && *value <= 'Z') || (*value >= 'a' && *value <= 'z') ||
+						(*value >= '0' && *value <= '9') || *value == '_')
+					value++;
+			}
+			if(value > name && (!braced || *value == '}')){
+				// look the name up without copying it out of the line
+				char end = *value;
+				*value = '\0';
+				copied = value + braced;
+				name = getenv(name);
+				*value = end;
+				if(name != NULL)
+					text_append(out, name, strlen(name));
+			}
+			else{
+				text_append(out, "$", 1);
+			}
+		}
+		c = strchr(copied, '$');
+	}
+	text_append(out, copied, strlen(copied) + 1);
+	return out->data;
+}
+
+/******************************************************************************
+ * int expand_pipeline(struct shell *, struct text_buffer *, struct arena *, struct pipeline *)
+ * 
+ * Expands the words of a parsed pipeline. Every argument with a $ in it is
+ * replaced by the fields its expansion splits into, and a file name by its
+ * expansion as one word. Since the pipeline was already tokenized, nothing
+ * a variable or a command prints can become an operator or a redirect. The
+ * new words live in the arena. Returns 0 on success and -1 if a $( isn't
+ * closed or a command is left with no words.
+ *****************************************************************************/
+int expand_pipeline(struct shell * sh, struct text_buffer * out, struct arena * arena, struct pipeline * pipeline){
+	struct redirect * redirect;
+	struct command * cmd;
+	char * text;
+	int i = 0;
+	int j;
+	for(; i < pipeline->num_cmds; i++){
+		cmd = &pipeline->cmds[i];
+		for(redirect = cmd->redirects; redirect != NULL; redirect = redirect->next){
+			if(redirect->type != REDIRECT_FILE || strchr(redirect->filename, '$') == NULL)
+				continue;
+			text = expand_variables(sh, out, redirect->filename);
+			if(text == NULL)
+				return -1;
+			redirect->filename = arena_strdup(arena, text);
+		}
+		for(j = 0; j < cmd->argc && strchr(cmd->argv[j], '$') == NULL; j++)
+			;
+		// most commands have nothing to expand
+		if(j == cmd->argc)
+			continue;
+		cmd->argv = expand_words(sh, out, arena, cmd->argv, cmd->argc, &cmd->argc);
+		if(cmd->argv == NULL)
+			return -1;
+		if(cmd->argc == 0){
+			fprintf(stderr, "smallsh: missing command\n");
+			return -1;
+		}
+	}
+	return 0;
+}
 
 /******************************************************************************
- * void wait_for_children(int *)
+ * char ** expand_words(struct shell *, struct text_buffer *, struct arena *, char **, int, int *)
  * 
- * Waits for any child process that hasn't completed yet
+ * Expands each of the words and splits what it expands to at blanks and
+ * newlines. A word that was tokenized has no blanks of its own, so they all
+ * came from a value or the output of a command. A word that expands to
+ * nothing is dropped. Returns the new words, ended by a null, in the arena
+ * and sets their count, or NULL if a $( isn't closed.
  *****************************************************************************/
-void wait_for_children(int *status, pid_t* background_pids, int* num_background_pids){
-	pid_t pid = waitpid(-1, status, WNOHANG);
-	int i;
-	while(pid > 0){
-		printf("Background process %d closed\n", pid);
-		i = 0;
-		for (; i < *num_background_pids; i++){
-			if(background_pids[i] == pid){
-				background_pids[i] = 0;
+char ** expand_words(struct shell * sh, struct text_buffer * out, struct arena * arena, char ** words, int count, int * num_words){
+	int capacity = count + INITIAL_ARGS;
+	char ** expanded = arena_alloc(arena, (capacity + 1) * sizeof(char *));
+	char * text;
+	char * end;
+	int argc = 0;
+	int i = 0;
+	for(; i < count; i++){
+		text = strchr(words[i], '$') == NULL ? words[i] : expand_variables(sh, out, words[i]);
+		if(text == NULL)
+			return NULL;
+		while(1){
+			while(*text == ' ' || *text == '\t' || *text == '\n')
+				text++;
+			if(*text == '\0')
+				break;
+			end = text;
+			while(*end != '\0' && *end != ' ' && *end != '\t' && *end != '\n')
+				end++;
+			if(argc == capacity){
+				// leave room for the null that ends the args
+				char ** bigger = arena_alloc(arena, (2 * capacity + 1) * sizeof(char *));
+				memcpy(bigger, expanded, capacity * sizeof(char *));
+				expanded = bigger;
+				capacity *= 2;
 			}
+			// a word that wasn't expanded stays where it is
+			expanded[argc++] = text == words[i] ? text : arena_strndup(arena, text, end - text);
+			text = end;
 		}
-		get_status(status);
-		pid = waitpid(-1, status, WNOHANG);
 	}
+	expanded[argc] = NULL;
+	*num_words = argc;
+	return expanded;
 }
 
 /******************************************************************************
- * void handle_fork_exec(int*, int, struct sigaction, char *, char *, char **)
+ * void text_append(struct text_buffer *, const char *, size_t)
  * 
- * Handles the fork and then the execution from there on. Will have the parent
- * wait for a child process if the child is in the foreground. Will not wait
- * if child is in the background.
+ * Appends the bytes to the buffer.
  *****************************************************************************/
-void handle_fork_exec(int * status, int fg, struct sigaction act, char * output_filename, char * input_filename, char ** commands, pid_t * background_pids, int*num_background_pids){
-	// fork the parent and the child processes
-	pid_t pid = fork();
-	// enter child/parent/error differentiator
-	if (pid == 0){
-		// this is the child
-		// intialize file desciptor, redirect number, filename pointer, and execution result number
-		int fd;
-		int redirect;
-		char * to_open = NULL;
-		int exec_result;
-		if(fg){
-			// if we are in the foreground, we want to be able to be interrupted
-			act.sa_handler = SIG_DFL;
-			act.sa_flags = 0;
-			sigaction(SIGINT, &act, NULL);
-			// if there is an input file, set the filename pointer to be the input filename
-			if(strcmp(input_filename, "") != 0)
-				to_open = input_filename;
-		}
-		else{ // we are in the background
-			// set the input filename pointer to be /dev/null
-			to_open = "/dev/null";
-		}
-		if (to_open != NULL){
-			// we either have an input file or we are in the background
-			// either way open a file descriptor to open the input file
-			fd = open(to_open, O_RDONLY);
-			// check for errors
-			if(fd < 0){
-				fprintf(stderr, "Error opening input file\n");
-				fflush(stdout);
-				exit(1);
-			}
-			// try to redirect the input to the file
-			redirect = dup2(fd, 0);
-			// if it fails exit
-			if(redirect < 0){
-				fprintf(stderr, "Error redirecting the input\n");
-				fflush(stdout);
-				exit(1);
-			}
-			close(fd);
-		}
-		if(strcmp(output_filename, "") != 0){
-			// in this case, we have an output file
-			// open the output file with writeonly & and create it and truncate all
-			// input to the end
-			fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-			// check for errors
-			if(fd < 0){
-				fprintf(stderr, "Error opening output file\n");
-				fflush(stdout);
-				exit(1);
-			}
-			// try to redirect the output to the file
-			redirect = dup2(fd, 1);
-			// if it fails exit
-			if(redirect < 0){
-				fprintf(stderr, "Error redirecting the output\n");
-				fflush(stdout);
-				exit(1);
-			}
-			close(fd);
-		}
-		// attemp to exec (since this only happens when we are not using a built in command)
-		exec_result = execvp(commands[0], commands);
-		// if the exec result is not 0, we had an error, print that
-		if(exec_result){
-			fprintf(stderr,"smallsh did not recognize the command: %s\n", commands[0]);
-			fflush(stdout);
+void text_append(struct text_buffer * text, const char * bytes, size_t length){
+	text_reserve(text, length);
+	memcpy(text->data + text->length, bytes, length);
+	text->length += length;
+}
+
+/******************************************************************************
+ * void text_reserve(struct text_buffer *, size_t)
+ * 
+ * Makes room for at least that many more bytes after the text.
+ *****************************************************************************/
+void text_reserve(struct text_buffer * text, size_t length){
+	if(text->length + length > text->capacity){
+		size_t capacity = text->capacity ? text->capacity : 256;
+		while(capacity < text->length + length)
+			capacity *= 2;
+		char * grown = realloc(text->data, capacity);
+		if(grown == NULL){
+			fprintf(stderr, "smallsh: out of memory\n");
 			exit(1);
 		}
-		
+		text->data = grown;
+		text->capacity = capacity;
+	}
+}
+
+/******************************************************************************
+ * char * substitution_end(char *)
+ * 
+ * Returns the ) that closes the $( at the start of the text, skipping over
+ * the parentheses nested inside it, or NULL if there is none.
+ *****************************************************************************/
+char * substitution_end(char * open){
+	int depth = 1;
+	char * c = open + 2;
+	for(; *c != '\0'; c++){
+		if(*c == '(')
+			depth++;
+		else if(*c == ')' && --depth == 0)
+			return c;
+	}
+	return NULL;
+}
+
+/******************************************************************************
+ * int substitute(struct shell *, struct text_buffer *, char *, size_t)
+ * 
+ * Runs the command text in a forked copy of the shell and appends what it
+ * prints to the buffer, read straight from a pipe into the buffer without
+ * the trailing newlines. The other newlines are blanks to expand_words, so
+ * the output splits into fields there. The copy starts with no jobs and no
+ * terminal, and expands substitutions nested in the command the same way,
+ * keeping their text in the same arena. Returns the exit code of the
+ * command.
+ *****************************************************************************/
+int substitute(struct shell * sh, struct text_buffer * out, char * text, size_t length){
+	char * command = arena_alloc(&sh->arena, length + 1);
+	size_t start = out->length;
+	ssize_t num_read;
+	int child_status = 0;
+	int fds[2];
+	pid_t pid;
+	memcpy(command, text, length);
+	command[length] = '\0';
+	if(pipe2(fds, O_CLOEXEC) < 0){
+		fprintf(stderr, "error creating a pipe\n");
+		return 1;
 	}
-	else if (pid < 0){// if the pid is negative
-		// whoops, forking error
-		// exit shell
+	// anything we printed has to come out before the command's output
+	fflush(stdout);
+	pid = fork();
+	if(pid < 0){
 		fprintf(stderr, "error in fork\n");
-		*status = 1;
-		exit_shell(status, background_pids, num_background_pids);
+		close(fds[0]);
+		close(fds[1]);
+		return 1;
 	}
-	else{
-		// we are the parent
-		// if we are in the bg, just wait until child is done
-		if(fg){
-			waitpid(pid, status, 0);
-			int exited_by_signal = WIFEXITED(*status); 
-			if (!exited_by_signal){
-				printf("The process was terminated by a signal %d\n", *status);
-			}
+	if(pid == 0){
+		// this is the copy, which only runs the command
+		dup2(fds[1], 1);
+		become_copy(sh);
+		run_line(sh, command);
+		fflush(stdout);
+		events_flush(&sh->events);
+		_exit(exit_code(sh->status));
+	}
+	close(fds[1]);
+	while(1){
+		text_reserve(out, 4096);
+		num_read = read(fds[0], out->data + out->length, out->capacity - out->length);
+		if(num_read < 0 && errno == EINTR)
+			continue;
+		if(num_read <= 0)
+			break;
+		out->length += num_read;
+	}
+	close(fds[0]);
+	while(waitpid(pid, &child_status, 0) < 0 && errno == EINTR)
+		;
+	while(out->length > start && out->data[out->length - 1] == '\n')
+		out->length--;
+	return exit_code(child_status);
+}
+
+/******************************************************************************
+ * void become_copy(struct shell *)
+ * 
+ * Turns a forked child into a shell of its own: the jobs, captures, buffered
+ * events and history it inherited belong to the parent, so it forgets them
+ * instead of waiting on, killing or writing them.
+ *****************************************************************************/
+void become_copy(struct shell * sh){
+	close(sh->signal_fd);
+	sh->signal_fd = setup_reaper();
+	job_table_init(&sh->jobs);
+	memset(&sh->captures, 0, sizeof(sh->captures));
+	sh->captures.epoll_fd = -1;
+	sh->captures.ring_size = sh->opts.capture_size;
+	sh->opts.terminal = 0;
+	sh->has_history = 0;
+	sh->events.buffer.length = 0;
+	sh->events.shell = getpid();
+	sh->forked = 1;
+}
+
+/******************************************************************************
+ * void * arena_alloc(struct arena *, size_t)
+ * 
+ * Hands out memory from the arena. Blocks left over from earlier lines are
+ * reused before a new one is malloc'd, so a rewound arena allocates nothing.
+ *****************************************************************************/
+void * arena_alloc(struct arena * arena, size_t size){
+	struct arena_block * block = arena->current;
+	// keep every allocation pointer aligned
+	size = (size + 15) & ~(size_t)15;
+	// walk forward through the blocks we already own
+	while(block != NULL && block->used + size > block->size){
+		block = block->next;
+		if(block != NULL)
+			block->used = 0;
+	}
+	if(block == NULL){
+		// out of blocks, chain a new one after the current one
+		size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		block = malloc(sizeof(struct arena_block) + block_size);
+		if(block == NULL){
+			fprintf(stderr, "smallsh: out of memory\n");
+			exit(1);
+		}
+		block->used = 0;
+		block->size = block_size;
+		if(arena->current == NULL){
+			block->next = NULL;
+			arena->head = block;
 		}
 		else{
-			// print the background process id
-			printf("Background process id number %d\n", pid);
-			// add the pid to the list
-			background_pids[*num_background_pids] = pid;
-			(*num_background_pids)++;
+			block->next = arena->current->next;
+			arena->current->next = block;
 		}
 	}
+	arena->current = block;
+	block->used += size;
+	return block->data + block->used - size;
+}
 
+/******************************************************************************
+ * char * arena_strdup(struct arena *, const char *)
+ * 
+ * Copies the string into the arena.
+ *****************************************************************************/
+char * arena_strdup(struct arena * arena, const char * string){
+	size_t length = strlen(string) + 1;
+	return memcpy(arena_alloc(arena, length), string, length);
 }
 
 /******************************************************************************
- * void exit_shell(int*)
+ * char * arena_strndup(struct arena *, const char *, size_t)
  * 
- * Exits the shell. Cleans up unfinished processes first.
+ * Copies that many bytes of the string into the arena, with a null after
+ * them.
  *****************************************************************************/
-void exit_shell(int * status, pid_t * background_pids, int * num_background_pids){
-	// wait for unfinished children
-	wait_for_children(status, background_pids, num_background_pids);
-	// exit shell
-	int i = 0;
-	for(; i < *num_background_pids; i++){
-		if(background_pids[i] !=0 ){
-			kill(background_pids[i], SIGKILL);
+char * arena_strndup(struct arena * arena, const char * string, size_t length){
+	char * copy = arena_alloc(arena, length + 1);
+	memcpy(copy, string, length);
+	copy[length] = '\0';
+	return copy;
+}
+
+/******************************************************************************
+ * void arena_reset(struct arena *)
+ * 
+ * Rewinds the arena to empty without giving any memory back.
+ *****************************************************************************/
+void arena_reset(struct arena * arena){
+	arena->current = arena->head;
+	if(arena->head != NULL)
+		arena->head->used = 0;
+}
+
+/******************************************************************************
+ * struct arena_mark arena_save(struct arena *)
+ * 
+ * Returns how far the arena is used, for arena_rewind.
+ *****************************************************************************/
+struct arena_mark arena_save(struct arena * arena){
+	struct arena_mark mark;
+	mark.block = arena->current;
+	mark.used = arena->current != NULL ? arena->current->used : 0;
+	return mark;
+}
+
+/******************************************************************************
+ * void arena_rewind(struct arena *, struct arena_mark *)
+ * 
+ * Gives back everything allocated since the mark was taken, keeping the
+ * memory for what comes next.
+ *****************************************************************************/
+void arena_rewind(struct arena * arena, struct arena_mark * mark){
+	if(mark->block == NULL){
+		arena_reset(arena);
+		return;
+	}
+	arena->current = mark->block;
+	mark->block->used = mark->used;
+}
+
+/******************************************************************************
+ * void arena_free(struct arena *)
+ * 
+ * Frees every block owned by the arena.
+ *****************************************************************************/
+void arena_free(struct arena * arena){
+	struct arena_block * block = arena->head;
+	while(block != NULL){
+		struct arena_block * next = block->next;
+		free(block);
+		block = next;
+	}
+	arena->head = NULL;
+	arena->current = NULL;
+}
+
+/******************************************************************************
+ * char * next_token(char **)
+ * 
+ * Returns the next whitespace separated word at the cursor and advances the
+ * cursor past it. A $(...) is part of its word, blanks and all. The word is
+ * terminated in place, nothing is copied. Returns NULL at the end of the line.
+ *****************************************************************************/
+char * next_token(char ** cursor){
+	char * start;
+	size_t length;
+	char * end = scan_word(*cursor, &start, &length);
+	// terminate the word and move past the separator
+	if(start != NULL && *end != '\0')
+		*end++ = '\0';
+	*cursor = end;
+	return start;
+}
+
+/******************************************************************************
+ * int split_list(char *, struct arena *, struct command_list *)
+ * 
+ * Splits the line into its commands at the words ;, &&, || and &, ending
+ * each command's text in place. An & stays at the end of its command, where
+ * parse_pipeline finds it. Separators inside a $(...) belong to it, and
+ * those of a loop to the loop. Nothing else is touched, so the commands can be
+ * expanded one at a time later. Returns 0 on success and -1 if a separator
+ * has no command in front of it.
+ *****************************************************************************/
+int split_list(char * line, struct arena * arena, struct command_list * list){
+	int capacity = 4;
+	int connector = LIST_ALWAYS;
+	int words = 0;
+	char * start = line;
+	char * word = line;
+	char * end;
+	list->items = arena_alloc(arena, capacity * sizeof(struct list_item));
+	list->count = 0;
+	while(1){
+		while(*word == ' ' || *word == '\t' || *word == '\n')
+			word++;
+		end = word;
+		while(*end != '\0' && *end != ' ' && *end != '\t' && *end != '\n'){
+			// a substitution is part of the word, blanks and all
+			if(end[0] == '$' && end[1] == '(' && substitution_end(end) != NULL)
+				end = substitution_end(end);
+			end++;
+		}
+		// the rest of a line that starts with a comment is the comment
+		if(*word == '#' && words == 0)
+			end = word + strlen(word);
+		// a loop is one command up to its done, lists and all
+		if(words == 0 && (is_keyword(word, end - word, "for") || is_keyword(word, end - word, "while"))){
+			char * done = NULL;
+			if(loop_depth(word, &done) == 0 && done != NULL)
+				end = done;
 		}
+		int length = end - word;
+		int separator = length == 0 ||
+			(length == 1 && (*word == ';' || *word == '&')) ||
+			(length == 2 && (strncmp(word, "&&", 2) == 0 || strncmp(word, "||", 2) == 0));
+		if(!separator){
+			words++;
+			word = end;
+			continue;
+		}
+		if(words == 0 && length > 0){
+			fprintf(stderr, "smallsh: syntax error near %.*s\n", length, word);
+			return -1;
+		}
+		if(words > 0){
+			if(list->count == capacity){
+				struct list_item * bigger = arena_alloc(arena, 2 * capacity * sizeof(struct list_item));
+				memcpy(bigger, list->items, capacity * sizeof(struct list_item));
+				list->items = bigger;
+				capacity *= 2;
+			}
+			list->items[list->count].text = start;
+			list->items[list->count].connector = connector;
+			list->count++;
+		}
+		else if(connector != LIST_ALWAYS){
+			// the line ended right after && or ||
+			fprintf(stderr, "smallsh: missing command after %s\n", connector == LIST_AND ? "&&" : "||");
+			return -1;
+		}
+		if(length == 0)
+			return 0;
+		// end the command's text, keeping a & as its last word
+		connector = length == 2 ? (*word == '&' ? LIST_AND : LIST_OR) : LIST_ALWAYS;
+		if(length == 1 && *word == '&'){
+			if(*end != '\0')
+				*end++ = '\0';
+		}
+		else{
+			*word = '\0';
+		}
+		start = end;
+		word = end;
+		words = 0;
 	}
-	free(background_pids);
-	exit(*status);
 }
 
 /******************************************************************************
- * void prompt(char *)
+ * int parse_pipeline(char *, struct arena *, struct pipeline *)
  * 
- * Takes user input and places it into the char pointer input
+ * Tokenizes the line in place into a pipeline of commands separated by |.
+ * The command and argv arrays come from the arena, and the words and
+ * filenames are pointers into the line itself. A line that is empty or starts
+ * with a comment parses to zero commands. A leading time marks the pipeline
+ * to have its resource usage printed. Returns 0 on success and -1 if the
+ * line is malformed.
  *****************************************************************************/
-void prompt(char * input){
-	// print the prompt
-	printf(": ");
-	// flush the output stream
-	fflush(stdout);
-	// get the input from the user
-	if(fgets(input, 2049, stdin) == NULL){
-		exit(0); // in the case that we reached the end of an input file
+int parse_pipeline(char * line, struct arena * arena, struct pipeline * pipeline){
+	char * cursor = line;
+	char * tok;
+	int capacity = 4;
+	int arg_capacity = 0;
+	struct command * cmd;
+	struct redirect redirect;
+	struct redirect ** redirect_tail = NULL;
+	int kind;
+	pipeline->cmds = arena_alloc(arena, capacity * sizeof(struct command));
+	pipeline->num_cmds = 0;
+	pipeline->fg = 1;
+	pipeline->batch_index = -1;
+	pipeline->timed = 0;
+	pipeline->cpus = NULL;
+	tok = next_token(&cursor);
+	// comments and blank lines have no commands at all
+	if(tok == NULL || *tok == '#')
+		return 0;
+	// time and pin CPUS come before the commands, in any order
+	while(tok != NULL && (strcmp(tok, "time") == 0 || strcmp(tok, "pin") == 0)){
+		if(*tok == 't'){
+			pipeline->timed = 1;
+		}
+		else{
+			char * list = next_token(&cursor);
+			pipeline->cpus = arena_alloc(arena, sizeof(cpu_set_t));
+			if(list == NULL || parse_cpu_list(list, pipeline->cpus) < 0){
+				fprintf(stderr, "smallsh: pin: expected a list of CPUs like 0-3,8\n");
+				return -1;
+			}
+		}
+		tok = next_token(&cursor);
+	}
+	if(tok == NULL)
+		return 0;
+	cmd = NULL;
+	while(tok != NULL){
+		if(cmd == NULL){
+			// start the next command of the pipeline
+			if(pipeline->num_cmds == capacity){
+				struct command * bigger = arena_alloc(arena, 2 * capacity * sizeof(struct command));
+				memcpy(bigger, pipeline->cmds, capacity * sizeof(struct command));
+				pipeline->cmds = bigger;
+				capacity *= 2;
+			}
+			cmd = &pipeline->cmds[pipeline->num_cmds++];
+			arg_capacity = INITIAL_ARGS;
+			cmd->argv = arena_alloc(arena, (arg_capacity + 1) * sizeof(char *));
+			cmd->argc = 0;
+			cmd->redirects = NULL;
+			cmd->num_redirects = 0;
+			redirect_tail = &cmd->redirects;
+		}
+		kind = parse_redirect(tok, &redirect, arena);
+		if(kind >= 0){
+			// the operator may be followed by its word
+			if(kind == 1){
+				char * word = next_token(&cursor);
+				if(word == NULL){
+					fprintf(stderr, "smallsh: missing file name after %s\n", tok);
+					return -1;
+				}
+				set_redirect_word(&redirect, word, arena);
+			}
+			*redirect_tail = arena_alloc(arena, sizeof(struct redirect));
+			**redirect_tail = redirect;
+			redirect_tail = &(*redirect_tail)->next;
+			cmd->num_redirects++;
+		}
+		else if(strcmp(tok, "|") == 0){
+			// the exec args must be terminated by a null
+			if(cmd->argc == 0){
+				fprintf(stderr, "smallsh: missing command before |\n");
+				return -1;
+			}
+			cmd->argv[cmd->argc] = NULL;
+			cmd = NULL;
+		}
+		else if(strcmp(tok, "&") == 0){
+			// in this case, we want the process to run in the
+			// background, this is the last arg in the command
+			pipeline->fg = 0;
+			break;
+		}
+		else{
+			if(cmd->argc == arg_capacity){
+				// leave room for the null that ends the args
+				char ** bigger = arena_alloc(arena, (2 * arg_capacity + 1) * sizeof(char *));
+				memcpy(bigger, cmd->argv, arg_capacity * sizeof(char *));
+				cmd->argv = bigger;
+				arg_capacity *= 2;
+			}
+			cmd->argv[cmd->argc++] = tok;
+		}
+		tok = next_token(&cursor);
 	}
+	if(cmd == NULL || cmd->argc == 0){
+		fprintf(stderr, "smallsh: missing command\n");
+		return -1;
+	}
+	// the exec args must be terminated by a null
+	cmd->argv[cmd->argc] = NULL;
+	return 0;
+}
 
+/******************************************************************************
+ * int parse_redirect(const char *, struct redirect *, struct arena *)
+ * 
+ * Checks whether the word is a redirect operator, one of <, >, >>, << and <<<
+ * with an optional descriptor number in front and optionally their word
+ * attached, or n>&m. Returns 1 for a redirect that still needs its word, 0
+ * for a complete redirect and -1 if the word isn't a redirect.
+ *****************************************************************************/
+int parse_redirect(const char * tok, struct redirect * redirect, struct arena * arena){
+	const char * op = tok;
+	char * end;
+	redirect->type = REDIRECT_FILE;
+	redirect->fd = -1;
+	redirect->filename = NULL;
+	redirect->source = -1;
+	redirect->body = NULL;
+	redirect->body_length = 0;
+	redirect->delimiter = NULL;
+	redirect->next = NULL;
+	while(*op >= '0' && *op <= '9')
+		op++;
+	if(op != tok)
+		redirect->fd = atoi(tok);
+	if(*op == '<'){
+		if(redirect->fd < 0)
+			redirect->fd = 0;
+		redirect->flags = O_RDONLY;
+		op++;
+		if(*op == '<'){
+			// << is a here-document and <<< a here-string, both take a word
+			redirect->type = REDIRECT_HEREDOC;
+			op++;
+			if(*op == '<'){
+				redirect->type = REDIRECT_HERESTRING;
+				op++;
+			}
+			if(*op != '\0'){
+				set_redirect_word(redirect, (char *)op, arena);
+				return 0;
+			}
+			return 1;
+		}
+	}
+	else if(*op == '>'){
+		if(redirect->fd < 0)
+			redirect->fd = 1;
+		if(op[1] == '&'){
+			if(op[2] < '0' || op[2] > '9')
+				return -1;
+			redirect->type = REDIRECT_DUP;
+			redirect->source = strtol(op + 2, &end, 10);
+			return *end == '\0' ? 0 : -1;
+		}
+		redirect->flags = O_WRONLY | O_CREAT | O_TRUNC;
+		op++;
+		if(*op == '>'){
+			// every write goes to the end of the file, no need to read it
+			redirect->flags = O_WRONLY | O_CREAT | O_APPEND;
+			op++;
+		}
+	}
+	else{
+		return -1;
+	}
+	// the file name may be attached, as in 2>/dev/null
+	if(*op != '\0'){
+		redirect->filename = (char *)op;
+		return 0;
+	}
+	return 1;
 }
 
 /******************************************************************************
- * void get_status(int*)
+ * void set_redirect_word(struct redirect *, char *, struct arena *)
  * 
- * gets the status of the shell using the status pointer, the WIFEXITED and 
- * WEXITSTATUS macros. If the process exited normally, we print the exit 
- * status. Else, the process was killed by a signal and we print the signal.
+ * Gives the redirect the word after its operator: the file name, the
+ * delimiter of a here-document or the text of a here-string. A here-string
+ * is copied into the arena with a newline on the end.
  *****************************************************************************/
-void get_status(int *status){
-	// if the status indicates that the process exited
-	if(WIFEXITED(*status)){
-		// let the user know that this is the case
-		int exitstatus = WEXITSTATUS(*status);
-		printf("The proccess' exit status was %d\n", exitstatus);
+void set_redirect_word(struct redirect * redirect, char * word, struct arena * arena){
+	if(redirect->type == REDIRECT_HEREDOC){
+		redirect->delimiter = word;
 	}
-	else{// the process was killed by a signal
-		printf("The process was terminated by a signal %d\n", *status);
+	else if(redirect->type == REDIRECT_HERESTRING){
+		redirect->body_length = strlen(word) + 1;
+		redirect->body = arena_alloc(arena, redirect->body_length);
+		memcpy(redirect->body, word, redirect->body_length - 1);
+		redirect->body[redirect->body_length - 1] = '\n';
+	}
+	else{
+		redirect->filename = word;
 	}
-	
 }
 
 /******************************************************************************
- * void change_directory(char **)
+ * int open_redirect(struct redirect *)
  * 
- * Changes the directory to the directory specified by the commands string 
- * array. If there is no directory specified, change to home directory.
+ * Opens the file of a redirect close on exec, or returns the source
+ * descriptor of a duplication, or a descriptor to read inline text from.
+ * Only the dup2 copy of the descriptor should reach a child. Prints an error
+ * and returns -1 on failure.
  *****************************************************************************/
-void change_directory(char ** commands){
-	// if the user specified a directory
-	if (commands[1] != NULL){
-		// change to the directory
-		chdir(commands[1]);
+int open_redirect(struct redirect * redirect){
+	int fd;
+	if(redirect->type == REDIRECT_HEREDOC || redirect->type == REDIRECT_HERESTRING)
+		return open_body(redirect->body, redirect->body_length);
+	if(redirect->type == REDIRECT_DUP){
+		// duplicating a descriptor that isn't open is an error, like in sh
+		if(fcntl(redirect->source, F_GETFD) < 0){
+			fprintf(stderr, "smallsh: %d: bad file descriptor\n", redirect->source);
+			return -1;
+		}
+		return redirect->source;
 	}
-	else{// change to home
-		chdir(getenv("HOME"));
+	fd = open(redirect->filename, redirect->flags | O_CLOEXEC, 0644);
+	if(fd < 0){
+		if(redirect->flags == O_RDONLY)
+			fprintf(stderr, "Error opening input file\n");
+		else
+			fprintf(stderr, "Error opening output file\n");
 	}
+	return fd;
 }
 
 /******************************************************************************
- * char ** create_char_array(int, int)
+ * int open_body(const char *, size_t)
  * 
- * creates an array of strings to be used for the commands. allocates on the
- * heap.
+ * Returns a descriptor that reads the text. Text that fits in a pipe is
+ * written into one up front, so nobody has to feed it while the command
+ * runs. Bigger text goes into a memfd, which is still only memory. The
+ * descriptor is close on exec. Returns -1 on failure.
  *****************************************************************************/
-char ** create_char_array(int arraysize, int stringsize){
-	// create the array of pointers to strings
-	char ** to_return = malloc(arraysize* sizeof(char *));
-	int i = 0;
-	for(; i < arraysize; i++){
-		// allocate the strings themselves
-		to_return[i] = malloc(stringsize*sizeof(char));
+int open_body(const char * body, size_t length){
+	int fds[2];
+	int fd;
+	size_t written = 0;
+	ssize_t num_written;
+	if(pipe2(fds, O_CLOEXEC) == 0){
+		if(length <= (size_t)fcntl(fds[1], F_GETPIPE_SZ)){
+			// nothing can block, the whole text fits in the pipe
+			while(written < length){
+				num_written = write(fds[1], body + written, length - written);
+				if(num_written < 0 && errno == EINTR)
+					continue;
+				if(num_written < 0)
+					break;
+				written += num_written;
+			}
+			close(fds[1]);
+			if(written == length)
+				return fds[0];
+			close(fds[0]);
+			fprintf(stderr, "Error writing the here-document\n");
+			return -1;
+		}
+		close(fds[0]);
+		close(fds[1]);
+	}
+	fd = memfd_create("smallsh-heredoc", MFD_CLOEXEC);
+	if(fd < 0){
+		fprintf(stderr, "Error creating the here-document\n");
+		return -1;
 	}
-	// return the array of strings pointer
-	return to_return;
+	while(written < length){
+		num_written = write(fd, body + written, length - written);
+		if(num_written < 0 && errno == EINTR)
+			continue;
+		if(num_written < 0){
+			fprintf(stderr, "Error writing the here-document\n");
+			close(fd);
+			return -1;
+		}
+		written += num_written;
+	}
+	lseek(fd, 0, SEEK_SET);
+	return fd;
 }
 
 /******************************************************************************
- * void delete_char_array(char **, int)
+ * void read_heredocs(struct line_reader *, struct arena *, struct pipeline *)
  * 
- * deletes the memory allocated to the array of strings
+ * Reads the bodies of the pipeline's here-documents from the lines that
+ * follow it, in the order they were given. The text is copied into the
+ * arena, since the reader is free to move its buffer. If the input ends
+ * first the body is whatever was read.
  *****************************************************************************/
-void delete_char_array(char ** to_delete, int arraysize){
+void read_heredocs(struct line_reader * reader, struct arena * arena, struct pipeline * pipeline){
+	struct redirect * redirect;
+	char * text = NULL;
+	size_t capacity = 0;
+	size_t length;
+	size_t line_length;
+	char * line;
 	int i = 0;
-	for (; i < arraysize; i++){
-		// delete the strings
-		free(to_delete[i]);
+	for(; i < pipeline->num_cmds; i++){
+		for(redirect = pipeline->cmds[i].redirects; redirect != NULL; redirect = redirect->next){
+			if(redirect->type != REDIRECT_HEREDOC)
+				continue;
+			length = 0;
+			while(1){
+				if(reader->interactive){
+					printf("> ");
+					fflush(stdout);
+				}
+				line = reader_next(reader);
+				if(line == NULL){
+					fprintf(stderr, "smallsh: here-document ended before %s\n", redirect->delimiter);
+					break;
+				}
+				if(strcmp(line, redirect->delimiter) == 0)
+					break;
+				line_length = strlen(line);
+				if(length + line_length + 1 > capacity){
+					capacity = 2 * (length + line_length + 1);
+					text = realloc(text, capacity);
+					if(text == NULL){
+						fprintf(stderr, "smallsh: out of memory\n");
+						exit(1);
+					}
+				}
+				memcpy(text + length, line, line_length);
+				text[length + line_length] = '\n';
+				length += line_length + 1;
+			}
+			redirect->body = arena_alloc(arena, length + 1);
+			if(length > 0)
+				memcpy(redirect->body, text, length);
+			redirect->body_length = length;
+		}
 	}
-	// delete the array of pointers to strings
-	free(to_delete);
+	free(text);
+}
+
+/******************************************************************************
+ * int has_heredoc(const char *)
+ * 
+ * Returns whether a line might start a here-document, in which case the
+ * lines after it have to be read before the command runs.
+ *****************************************************************************/
+int has_heredoc(const char * line){
+	return strstr(line, "<<") != NULL;
+}
+
+/******************************************************************************
+ * int reads_input(struct command *)
+ * 
+ * Returns whether the command redirects its stdin.
+ *****************************************************************************/
+int reads_input(struct command * cmd){
+	struct redirect * redirect = cmd->redirects;
+	for(; redirect != NULL; redirect = redirect->next)
+		if(redirect->fd == 0)
+			return 1;
+	return 0;
 }
 
 /******************************************************************************
- * char ** reset_command_array(char**, int, int)
+ * void close_redirects(struct command *, int *, int)
  * 
- * deletes the char array, and reallocates it. Also, memsets all of the
- * strings to be 0. This is to avoid a weird strcpy offset error, where
- * commands[1] is set to NULL and thus is no longer a char *.
+ * Closes the files opened for the first count redirects of the command. The
+ * descriptors of duplications belong to the shell and are left alone.
  *****************************************************************************/
-char ** reset_command_array(char ** commands, int arraysize, int stringsize){
-	// delete the array of strings
-    delete_char_array(commands, arraysize);
-	// create a new array of strings
-	char ** new_array = create_char_array(arraysize, stringsize);
-	// memset every string to be 0's
+void close_redirects(struct command * cmd, int * opened, int count){
+	struct redirect * redirect = cmd->redirects;
 	int i = 0;
-	for (;i < arraysize; i++){
-		memset(new_array[0], 0, stringsize);
+	for(; i < count; i++, redirect = redirect->next)
+		if(redirect->type != REDIRECT_DUP)
+			close(opened[i]);
+}
+
+/******************************************************************************
+ * int kept_fds(struct command *, int *)
+ * 
+ * Fills kept with the descriptors above 2 that the command redirects, in
+ * increasing order and without repeats. Returns how many there are.
+ *****************************************************************************/
+int kept_fds(struct command * cmd, int * kept){
+	struct redirect * redirect = cmd->redirects;
+	int num_kept = 0;
+	int i;
+	for(; redirect != NULL; redirect = redirect->next){
+		if(redirect->fd <= 2)
+			continue;
+		// insertion sort, commands only ever have a few redirects
+		for(i = num_kept; i > 0 && kept[i - 1] > redirect->fd; i--)
+			kept[i] = kept[i - 1];
+		if(i > 0 && kept[i - 1] == redirect->fd){
+			// already there, undo the shift
+			for(; i < num_kept; i++)
+				kept[i] = kept[i + 1];
+			continue;
+		}
+		kept[i] = redirect->fd;
+		num_kept++;
 	}
-	// return the new array of strings
-	return new_array;
+	return num_kept;
 }
 
 /******************************************************************************
- * void run_shell
+ * void shell_init(struct shell *)
  * 
- * runs the shell, calling all above functions.
+ * Sets up everything a shell needs before it reads its first line except
+ * the reader, and with no history.
  *****************************************************************************/
-void run_shell(){
+void shell_init(struct shell * sh){
 	//setup to ignore a signal interrupt
-	struct sigaction act;
-	act.sa_handler = SIG_IGN;
-	act.sa_flags = 0;
-	sigfillset(&(act.sa_mask));
-	sigaction(SIGINT, &act, NULL);
-
-	// create an input buffer
-	char * input = malloc(2049 * sizeof(char));
-	// create a command string
-	char ** commands = create_char_array(513, 513);
-	// create indicators for foreground and background
-	int fg = 0;
-	// create input file and output file buffers
-	char * input_filename = malloc(100 * sizeof(char));
-	char * output_filename = malloc(100 * sizeof(char));
-	// create a buffer for the tokens in the string tokenizer
-	char * tok;
+	sh->act.sa_handler = SIG_IGN;
+	sh->act.sa_flags = 0;
+	sigfillset(&(sh->act.sa_mask));
+	sigaction(SIGINT, &sh->act, NULL);
+	// read the settings, then if we own the terminal ignore SIGTTOU so we
+	// can take it back from foreground jobs, and ^Z so it only stops them
+	load_options(&sh->opts);
+	if(sh->opts.terminal){
+		sigaction(SIGTTOU, &sh->act, NULL);
+		sigaction(SIGTTIN, &sh->act, NULL);
+		sigaction(SIGTSTP, &sh->act, NULL);
+	}
+	// get told about finished children through a signalfd
+	sh->signal_fd = setup_reaper();
+	// the arena that backs the commands of a line
+	sh->arena.head = NULL;
+	sh->arena.current = NULL;
 	// keep track of the status
-	int status = 0;
-	// keep track of all background pids
-	pid_t * background_pids = malloc(10000 * sizeof(pid_t));
-	int num_background_pids = 0;
-	// set all of the strings to be all 0's (make sure that they are clean)
-	memset(background_pids, 0, sizeof(background_pids));
-	memset(input, 0, sizeof(input));
-	memset(input_filename,0, sizeof(input_filename));
-	memset(output_filename, 0, sizeof(output_filename));
+	sh->status = 0;
+	// keep track of all background jobs
+	job_table_init(&sh->jobs);
+	builtin_index_init(sh);
+	memset(&sh->commands, 0, sizeof(sh->commands));
+	memset(&sh->stats, 0, sizeof(sh->stats));
+	memset(&sh->expanded, 0, sizeof(sh->expanded));
+	memset(&sh->captures, 0, sizeof(sh->captures));
+	sh->captures.epoll_fd = -1;
+	sh->captures.ring_size = sh->opts.capture_size;
+	memset(&sh->limits, 0, sizeof(sh->limits));
+	memset(&sh->placement, 0, sizeof(sh->placement));
+	memset(&sh->dirs, 0, sizeof(sh->dirs));
+	memset(&sh->events, 0, sizeof(sh->events));
+	memset(&sh->definitions, 0, sizeof(sh->definitions));
+	sh->args = NULL;
+	sh->num_args = 0;
+	sh->call_depth = 0;
+	sh->forked = 0;
+	sh->events.fd = sh->opts.event_fd;
+	sh->events.shell = getpid();
+	sh->has_history = 0;
+}
+
+/******************************************************************************
+ * void run_shell(char *)
+ * 
+ * runs the shell, calling all above functions. Reads the commands from the
+ * script if there is one, and from stdin otherwise.
+ *****************************************************************************/
+void run_shell(char * script){
+	struct shell sh;
+	char * input;
+	shell_init(&sh);
+	// create an input buffer that reads straight from the script or stdin,
+	// only prompting when a user is typing at us
+	if(script != NULL){
+		int fd = shell_fd(open(script, O_RDONLY | O_CLOEXEC));
+		if(fd < 0){
+			fprintf(stderr, "smallsh: cannot open %s: %s\n", script, strerror(errno));
+			exit(1);
+		}
+		reader_init(&sh.reader, fd, 0);
+		// a mapping stays valid after its descriptor is closed
+		if(sh.reader.mapped)
+			close(fd);
+	}
+	else{
+		reader_init(&sh.reader, 0, isatty(0));
+	}
+	// only what a user typed is worth remembering
+	sh.has_history = sh.reader.interactive;
+	if(sh.has_history)
+		history_init(&sh.history, &sh.opts);
 	// run forever until we type exit
 	while(1){
-		// initialize shell to be in the foreground
-		fg = 1;
-		// prompt the user for input
-		prompt(input);
-		
-		// determine what our input is
-		int i = 0;
-		// get our first token
-		tok = strtok(input, " \n");
-		// while we have more tokens
-		while(tok != NULL){
-			// if we are redirecting output
-			if(strcmp(tok, ">") == 0){
-				// grab the next token because it
-				// will be the name of the output file
-				tok = strtok(NULL, " \n");
-				// copy that token to the output filename
-				strcpy(output_filename, tok);
-				// get the next token (most likely null)
-				tok = strtok(NULL, " \n");
-			}
-			else if(strcmp(tok, "<") == 0){
-				// in this case we are injecting input
-				// grab the next token to grab the name
-				// of the input file
-				tok = strtok(NULL, " \n");
-				// copy the name of the input file to the input filename
-				strcpy(input_filename, tok);
-				// grab the next token
-				tok = strtok(NULL, " \n");
-			}
-			else if(strcmp(tok, "&") == 0){
-				// in this case, we want the process to run
-				// in the background, set fg to 0 and break
-				// since this is the last arg in the command
-				fg = 0;
-				break;
-			}
-			else{// we are not using a special character
-				// copy the contents of the string to the
-				// command array and grab the next token
-				strcpy(commands[i], tok);
-				tok = strtok(NULL, " \n");
-				i++;
+		// prompt the user for input, reaping anything that finishes meanwhile
+		input = prompt(&sh);
+		// parse the line, the arena is rewound so this never mallocs
+		arena_reset(&sh.arena);
+		if(sh.has_history){
+			// replace !! and !N before anything else looks at the line
+			input = expand_history(&sh, input);
+			if(input == NULL){
+				sh.status = W_EXITCODE(1, 0);
+				continue;
 			}
+			history_add(&sh.history, input);
 		}
-		// must set the last arg to null, since we will use it in
-		// the exec args
-		if (i != 0)
-			commands[i] = NULL;
+		run_line(&sh, input);
+	}
 
-		// if the first character of the first command is a comment, then skip it
-		if(strcmp(commands[0], "") == 0 || strcmp(commands[0], "\n") == 0){
-		    // don't do anything
-		}
-		else if(*(commands[0]) == '#'){
-			// don't do anything
+	// if we somehow get here, exit
+	exit_shell(&sh);
+}
+
+/******************************************************************************
+ * void run_line(struct shell *, char *)
+ * 
+ * Splits the line into its list of commands and runs them, in the arena the
+ * caller has rewound.
+ *****************************************************************************/
+void run_line(struct shell * sh, char * input){
+	struct command_list list;
+	char * word = input;
+	// a function definition goes on until its }, lists and all
+	while(*word == ' ' || *word == '\t')
+		word++;
+	if(strncmp(word, "function", 8) == 0 && (word[8] == '\0' || word[8] == ' ' || word[8] == '\t')){
+		sh->status = W_EXITCODE(define_function(sh, word) < 0 ? 1 : 0, 0);
+		return;
+	}
+	// a loop goes on over the lines up to its done
+	if(loop_depth(input, NULL) > 0){
+		struct text_buffer text = { NULL, 0, 0 };
+		text_append(&text, input, strlen(input) + 1);
+		text.length--;
+		while(loop_depth(text.data, NULL) > 0){
+			if(read_continued(sh, &text) < 0){
+				fprintf(stderr, "smallsh: missing done\n");
+				free(text.data);
+				sh->status = W_EXITCODE(1, 0);
+				return;
+			}
 		}
-		else if (strcmp(commands[0], "cd") == 0){
-			// We need to change the directory, call this function
-			change_directory(commands);
+		input = arena_strdup(&sh->arena, text.data);
+		free(text.data);
+	}
+	// a here-document reads on, which may move a buffered line, and so
+	// may parallel taking its jobs from our input
+	if(!sh->reader.mapped && (has_heredoc(input) || strstr(input, "parallel") != NULL))
+		input = arena_strdup(&sh->arena, input);
+	if(split_list(input, &sh->arena, &list) < 0){
+		sh->status = W_EXITCODE(1, 0);
+		return;
+	}
+	run_list(sh, &list);
+}
+
+/******************************************************************************
+ * void run_server(const char *)
+ * 
+ * Listens on the Unix socket and keeps SMALLSH_WORKERS shells accepting
+ * connections on it, starting a new one whenever one exits. The workers are
+ * forked from a shell that is already set up, so a connection never waits
+ * for a shell to start.
+ *****************************************************************************/
+void run_server(const char * path){
+	struct shell sh;
+	pid_t * workers;
+	pid_t pid;
+	int listen_fd;
+	int worker_status;
+	int i = 0;
+	shell_init(&sh);
+	// a server has no terminal to hand to its jobs
+	sh.opts.terminal = 0;
+	listen_fd = listen_on(path);
+	if(listen_fd < 0){
+		fprintf(stderr, "smallsh: cannot listen on %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	workers = malloc(sh.opts.workers * sizeof(pid_t));
+	for(; i < sh.opts.workers; i++)
+		workers[i] = start_worker(&sh, listen_fd);
+	// workers only exit on exit or a fatal error, put a new one in its place
+	while((pid = waitpid(-1, &worker_status, 0)) > 0 || errno == EINTR){
+		for(i = 0; i < sh.opts.workers; i++){
+			if(pid > 0 && workers[i] == pid){
+				// don't spin on a worker that can't get going
+				if(!WIFEXITED(worker_status) || WEXITSTATUS(worker_status) != 0)
+					sleep(1);
+				workers[i] = start_worker(&sh, listen_fd);
+			}
 		}
-		else if (strcmp(commands[0], "status") == 0){
-			// if the user wants the status, give it to them
-			get_status(&status);
+	}
+	free(workers);
+	exit(1);
+}
+
+/******************************************************************************
+ * int listen_on(const char *)
+ * 
+ * Returns a socket listening on the path, replacing a socket that was left
+ * there by a server that is gone, or -1 if that can't be done.
+ *****************************************************************************/
+int listen_on(const char * path){
+	struct sockaddr_un address = { 0 };
+	struct stat info;
+	int fd;
+	if(strlen(path) >= sizeof(address.sun_path)){
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	fd = shell_fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+	if(fd < 0)
+		return -1;
+	if(lstat(path, &info) == 0 && S_ISSOCK(info.st_mode))
+		unlink(path);
+	if(bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/******************************************************************************
+ * pid_t start_worker(struct shell *, int)
+ * 
+ * Forks a worker that accepts connections on the socket one at a time. Each
+ * of them is served until the client hangs up by a fork of the worker,
+ * which never runs anything itself, so every client starts from the same
+ * shell and whatever it changed or left running goes away with its fork.
+ * The worker dies with the server, and the fork with the worker.
+ *****************************************************************************/
+pid_t start_worker(struct shell * sh, int listen_fd){
+	pid_t pid = fork();
+	pid_t served;
+	int conn;
+	if(pid != 0){
+		if(pid < 0)
+			fprintf(stderr, "smallsh: could not start a worker\n");
+		return pid;
+	}
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	while(1){
+		conn = shell_fd(accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC));
+		if(conn < 0){
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fprintf(stderr, "smallsh: accept failed: %s\n", strerror(errno));
+			exit(1);
 		}
-		else if (strcmp(commands[0], "exit") == 0){
-			// if the user wants to exit, exit
-			// make sure that we don't leak memory
-			free(input);
-			free(input_filename);
-			free(output_filename);
-			delete_char_array(commands, sizeof(commands));
-			exit_shell(&status, background_pids, &num_background_pids);
+		served = fork();
+		if(served == 0){
+			prctl(PR_SET_PDEATHSIG, SIGTERM);
+			close(listen_fd);
+			// the signalfd should only ever be polled by the process that
+			// made it
+			close(sh->signal_fd);
+			sh->signal_fd = setup_reaper();
+			sh->events.shell = getpid();
+			serve_connection(sh, conn);
+			// the jobs the client left running get the usual shutdown
+			exit_shell(sh);
 		}
-		else{
-			// the user passed in a command that is not built in, handle it.
-			handle_fork_exec(&status, fg, act, output_filename, input_filename, commands, background_pids, &num_background_pids);
+		if(served < 0)
+			fprintf(stderr, "smallsh: could not fork for a connection\n");
+		close(conn);
+		while(served > 0 && waitpid(served, NULL, 0) < 0 && errno == EINTR)
+			;
+	}
+}
+
+/******************************************************************************
+ * void serve_connection(struct shell *, int)
+ * 
+ * Runs the lines a client sends, each with the stdin, stdout and stderr the
+ * client sent along with it. Without them, commands read /dev/null and
+ * write to the connection. Every line is answered with a null byte, the
+ * exit code of the line and a newline.
+ *****************************************************************************/
+void serve_connection(struct shell * sh, int conn){
+	int saved[3];
+	int fds[3];
+	char * input;
+	int i = 0;
+	// put our own stdin, stdout and stderr back after every line
+	for(; i < 3; i++)
+		saved[i] = fcntl(i, F_DUPFD_CLOEXEC, SHELL_FDS);
+	reader_init(&sh->reader, conn, 0);
+	sh->reader.receives_fds = 1;
+	while((input = next_request(sh)) != NULL){
+		take_passed(&sh->reader, fds);
+		fflush(stdout);
+		if(fds[0] < 0)
+			fds[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+		for(i = 0; i < 3; i++){
+			dup2(fds[i] >= 0 ? fds[i] : conn, i);
+			if(fds[i] >= 0)
+				close(fds[i]);
 		}
-		// wait for any children that haven't finished processing
-		wait_for_children(&status, background_pids, &num_background_pids);
-		// reset the input to empty
-		memset(input, 0, sizeof(input));
-		memset(input_filename,0, sizeof(input_filename));
-		memset(output_filename, 0, sizeof(output_filename));
-		commands = reset_command_array(commands, 513, 513);
+		arena_reset(&sh->arena);
+		run_line(sh, input);
+		fflush(stdout);
+		for(i = 0; i < 3; i++)
+			dup2(saved[i], i);
+		dprintf(conn, "%c%d\n", '\0', exit_code(sh->status));
 	}
+	reader_free(&sh->reader);
+	close(conn);
+	for(i = 0; i < 3; i++)
+		close(saved[i]);
+}
 
-	// make sure that we don't leak memory
-	free(input);
-	free(input_filename);
-	free(output_filename);
-	delete_char_array(commands, sizeof(commands));
-	// if we somehow get here, exit
-	exit_shell(&status, background_pids, &num_background_pids);
+/******************************************************************************
+ * char * next_request(struct shell *)
+ * 
+ * Waits for the next line from a client the way prompt does, reaping the
+ * jobs that finish meanwhile. Returns NULL once the client hangs up.
+ *****************************************************************************/
+char * next_request(struct shell * sh){
+	struct line_reader * reader = &sh->reader;
+	struct pollfd fds[3] = { { 0 } };
+	char * line;
+	ssize_t num_read;
+	int num_fds;
+	if(sh->jobs.num_jobs > 0 && drain_signals(sh->signal_fd))
+		wait_for_children(sh);
+	fflush(stdout);
+	while((line = next_line(reader)) == NULL){
+		events_flush(&sh->events);
+		fds[0].fd = reader->fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = sh->jobs.num_jobs > 0 ? sh->signal_fd : -1;
+		fds[1].events = POLLIN;
+		fds[2].fd = sh->captures.epoll_fd;
+		fds[2].events = POLLIN;
+		num_fds = sh->captures.num_open > 0 ? 3 : sh->jobs.num_jobs > 0 ? 2 : 1;
+		if(poll(fds, num_fds, -1) < 0 && errno != EINTR)
+			return NULL;
+		if(fds[2].revents & POLLIN)
+			drain_captures(&sh->captures);
+		if(sh->jobs.num_jobs > 0 && (fds[1].revents & POLLIN) && drain_signals(sh->signal_fd)){
+			wait_for_children(sh);
+			fflush(stdout);
+		}
+		if(fds[0].revents == 0)
+			continue;
+		num_read = reader_fill(reader);
+		if(num_read < 0 && errno == EINTR)
+			continue;
+		if(num_read <= 0)
+			return reader_rest(reader);
+	}
+	return line;
 }
 
 /******************************************************************************
- * int main()
+ * int main(int, char **)
  * 
- * main method. runs the shell.
+ * main method. runs the shell, on the script if one is given.
  *****************************************************************************/
-int main(){
-	run_shell();
+int main(int argc, char ** argv){
+	if(argc > 2 && strcmp(argv[1], "--serve") == 0)
+		run_server(argv[2]);
+	run_shell(argc > 1 ? argv[1] : NULL);
 	return 0;
 }
@@ -0,0 +1,410 @@
+/******************************************************************************
+ * smallsh_bench.c
+ *
+ * Description: Benchmarks for smallsh. Drives one or more shell binaries
+ * with synthetic scripts and reports how fast they get through them, under
+ * both launch engines, so changes to the shell can be compared.
+ *
+ * Build it next to the shell and run it on one binary or several, e.g. one
+ * built from before a change and one from after:
+ *
+ *     gcc -O2 -o smallsh smallsh.c
+ *     gcc -O2 -o smallsh_bench smallsh_bench.c
+ *     ./smallsh_bench [-n N] [SHELL ...]
+ *
+ * SHELL defaults to ./smallsh and N, the number of lines in each script, to
+ * 2000. The workloads are:
+ *
+ *   spawn     N external commands, /bin/true
+ *   builtin   N built in commands, true
+ *   tokens    N lines of 200 words each given to a built in, which mostly
+ *             measures the parser
+ *   redirect  N built ins and N external commands with three redirects
+ *   jobs      N background jobs of /bin/true, then wait
+ *   reap      how long after a background job exits the shell reports it,
+ *             measured over N / 20 jobs while the shell idles at the prompt
+ *
+ * The scripts are written to a temporary directory and given to the shell
+ * as its stdin with the output thrown away, so shells without script mode
+ * can be measured too. Reap types at the shell through a pipe and watches
+ * its output instead, and gives up on a shell that doesn't report a job
+ * within two seconds.
+ *****************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+
+// Words on each line of the tokens workload
+#define TOKEN_WORDS 200
+// How long to wait for the shell to report a job, in milliseconds
+#define REAP_TIMEOUT 2000
+
+// Launch engines the shell is run with, see SMALLSH_ENGINE
+static const char * engines[] = { "spawn", "fork" };
+
+// A workload, which writes its script of n lines and says how many
+// operations the script does
+struct workload {
+	const char * name;
+	long (*write_script)(FILE *, long);
+	const char * unit;
+};
+
+// Function declarators
+double now();
+long write_spawn(FILE *, long);
+long write_builtin(FILE *, long);
+long write_tokens(FILE *, long);
+long write_redirect(FILE *, long);
+long write_jobs(FILE *, long);
+double run_script(const char *, const char *, const char *);
+void run_workload(const char *, const char *, struct workload *, long);
+void run_reap(const char *, const char *, const char *, long);
+int read_report(int, double *);
+int compare_doubles(const void *, const void *);
+void print_stamp();
+void remove_file(const char *);
+
+static char script_dir[] = "/tmp/smallsh_bench.XXXXXX";
+
+struct workload workloads[] = {
+	{ "spawn", write_spawn, "commands" },
+	{ "builtin", write_builtin, "commands" },
+	{ "tokens", write_tokens, "lines" },
+	{ "redirect", write_redirect, "commands" },
+	{ "jobs", write_jobs, "jobs" },
+};
+
+/******************************************************************************
+ * double now()
+ *
+ * Returns the monotonic clock in seconds.
+ *****************************************************************************/
+double now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/******************************************************************************
+ * long write_spawn(FILE *, long)
+ *
+ * n external commands that do nothing, so the time is all launching.
+ *****************************************************************************/
+long write_spawn(FILE * script, long n){
+	long i = 0;
+	for(; i < n; i++)
+		fputs("/bin/true\n", script);
+	return n;
+}
+
+/******************************************************************************
+ * long write_builtin(FILE *, long)
+ *
+ * n built in commands, the cost of reading, parsing and dispatching a line.
+ *****************************************************************************/
+long write_builtin(FILE * script, long n){
+	long i = 0;
+	for(; i < n; i++)
+		fputs("true\n", script);
+	return n;
+}
+
+/******************************************************************************
+ * long write_tokens(FILE *, long)
+ *
+ * n long lines of words for a built in that ignores them.
+ *****************************************************************************/
+long write_tokens(FILE * script, long n){
+	long i = 0;
+	int j;
+	for(; i < n; i++){
+		fputs("true", script);
+		for(j = 0; j < TOKEN_WORDS; j++)
+			fprintf(script, " word%d", j);
+		fputc('\n', script);
+	}
+	return n;
+}
+
+/******************************************************************************
+ * long write_redirect(FILE *, long)
+ *
+ * n built ins and n external commands, each redirecting all three standard
+ * descriptors.
+ *****************************************************************************/
+long write_redirect(FILE * script, long n){
+	long i = 0;
+	for(; i < n; i++){
+		fprintf(script, "echo %ld < /dev/null > %s/out 2>&1\n", i, script_dir);
+		fprintf(script, "/bin/true < /dev/null >> %s/out 2> /dev/null\n", script_dir);
+	}
+	return 2 * n;
+}
+
+/******************************************************************************
+ * long write_jobs(FILE *, long)
+ *
+ * n background jobs, then a wait for all of them.
+ *****************************************************************************/
+long write_jobs(FILE * script, long n){
+	long i = 0;
+	for(; i < n; i++)
+		fputs("/bin/true &\n", script);
+	fputs("wait\n", script);
+	return n;
+}
+
+/******************************************************************************
+ * double run_script(const char *, const char *, const char *)
+ *
+ * Runs the shell with the engine and the script as its stdin, which works
+ * for shells that don't take a script argument too. The output is thrown
+ * away. Returns the seconds it took, or -1 if it couldn't be run.
+ *****************************************************************************/
+double run_script(const char * shell, const char * engine, const char * script){
+	double start = now();
+	int status;
+	pid_t pid = fork();
+	if(pid < 0)
+		return -1;
+	if(pid == 0){
+		int null_fd = open("/dev/null", O_RDWR);
+		int script_fd = open(script, O_RDONLY);
+		dup2(script_fd, 0);
+		dup2(null_fd, 1);
+		dup2(null_fd, 2);
+		setenv("SMALLSH_ENGINE", engine, 1);
+		execl(shell, shell, (char *)NULL);
+		_exit(127);
+	}
+	waitpid(pid, &status, 0);
+	if(!WIFEXITED(status) || WEXITSTATUS(status) == 127)
+		return -1;
+	return now() - start;
+}
+
+/******************************************************************************
+ * void run_workload(const char *, const char *, struct workload *, long)
+ *
+ * Writes the workload's script, runs it and prints one row of results.
+ *****************************************************************************/
+void run_workload(const char * shell, const char * engine, struct workload * workload, long n){
+	char path[sizeof(script_dir) + 32];
+	FILE * script;
+	long ops;
+	double seconds;
+	snprintf(path, sizeof(path), "%s/%s", script_dir, workload->name);
+	script = fopen(path, "w");
+	if(script == NULL){
+		fprintf(stderr, "smallsh_bench: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	ops = workload->write_script(script, n);
+	fclose(script);
+	seconds = run_script(shell, engine, path);
+	if(seconds < 0){
+		printf("%-20s %-6s %-9s failed to run\n", shell, engine, workload->name);
+		return;
+	}
+	printf("%-20s %-6s %-9s %10.1f %-8s/s %10.2f us each\n", shell, engine,
+		workload->name, ops / seconds, workload->unit, seconds / ops * 1e6);
+}
+
+/******************************************************************************
+ * void run_reap(const char *, const char *, const char *, long)
+ *
+ * Starts the shell on a pipe and gives it background jobs one at a time,
+ * waiting for each to be reported before the next. Each job is this program
+ * printing the monotonic clock right before it exits, so the latency is the
+ * time from that stamp to the shell's report of the job.
+ *****************************************************************************/
+void run_reap(const char * shell, const char * engine, const char * self, long samples){
+	int to_shell[2];
+	int from_shell[2];
+	double * latencies = malloc(samples * sizeof(double));
+	double stamp;
+	long i = 0;
+	int status;
+	pid_t pid;
+	if(pipe(to_shell) < 0 || pipe(from_shell) < 0){
+		fprintf(stderr, "smallsh_bench: pipe: %s\n", strerror(errno));
+		exit(1);
+	}
+	pid = fork();
+	if(pid == 0){
+		dup2(to_shell[0], 0);
+		dup2(from_shell[1], 1);
+		close(to_shell[0]);
+		close(to_shell[1]);
+		close(from_shell[0]);
+		close(from_shell[1]);
+		setenv("SMALLSH_ENGINE", engine, 1);
+		execl(shell, shell, (char *)NULL);
+		_exit(127);
+	}
+	close(to_shell[0]);
+	close(from_shell[1]);
+	for(; i < samples; i++){
+		dprintf(to_shell[1], "%s --stamp &\n", self);
+		if(read_report(from_shell[0], &stamp) < 0)
+			break;
+		latencies[i] = now() - stamp;
+	}
+	close(to_shell[1]);
+	// a shell that only reports jobs after the next command never gets here
+	if(i < samples)
+		kill(pid, SIGKILL);
+	waitpid(pid, &status, 0);
+	close(from_shell[0]);
+	if(i < samples){
+		printf("%-20s %-6s %-9s no report within %d ms\n", shell, engine, "reap", REAP_TIMEOUT);
+		free(latencies);
+		return;
+	}
+	qsort(latencies, samples, sizeof(double), compare_doubles);
+	printf("%-20s %-6s %-9s %10.1f us p50 %10.1f us p99\n", shell, engine, "reap",
+		latencies[samples / 2] * 1e6, latencies[(samples * 99) / 100] * 1e6);
+	free(latencies);
+}
+
+/******************************************************************************
+ * int read_report(int, double *)
+ *
+ * Reads the shell's output until it reports that a job closed, picking up
+ * the stamp the job printed on the way. Returns 0 once the report is in and
+ * -1 if it doesn't come in time.
+ *****************************************************************************/
+int read_report(int fd, double * stamp){
+	static char buf[4096];
+	static size_t length = 0;
+	struct pollfd fds = { fd, POLLIN, 0 };
+	char * line;
+	char * newline;
+	ssize_t num_read;
+	while(1){
+		// look at the whole lines we have
+		line = buf;
+		while((newline = memchr(line, '\n', buf + length - line)) != NULL){
+			*newline = '\0';
+			if(strncmp(line, "stamp ", 6) == 0)
+				*stamp = atof(line + 6);
+			if(strstr(line, " closed") != NULL){
+				length -= newline + 1 - buf;
+				memmove(buf, newline + 1, length);
+				return 0;
+			}
+			line = newline + 1;
+		}
+		length -= line - buf;
+		memmove(buf, line, length);
+		if(length == sizeof(buf))
+			length = 0;
+		if(poll(&fds, 1, REAP_TIMEOUT) <= 0)
+			return -1;
+		num_read = read(fd, buf + length, sizeof(buf) - length);
+		if(num_read <= 0)
+			return -1;
+		length += num_read;
+	}
+}
+
+/******************************************************************************
+ * int compare_doubles(const void *, const void *)
+ *
+ * qsort comparison of two doubles.
+ *****************************************************************************/
+int compare_doubles(const void * a, const void * b){
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/******************************************************************************
+ * void print_stamp()
+ *
+ * What a reap job runs: prints the monotonic clock and exits.
+ *****************************************************************************/
+void print_stamp(){
+	printf("stamp %.9f\n", now());
+	fflush(stdout);
+}
+
+/******************************************************************************
+ * void remove_file(const char *)
+ *
+ * Removes a file from the script directory.
+ *****************************************************************************/
+void remove_file(const char * name){
+	char path[sizeof(script_dir) + 32];
+	snprintf(path, sizeof(path), "%s/%s", script_dir, name);
+	unlink(path);
+}
+
+/******************************************************************************
+ * int main(int, char **)
+ *
+ * main method. runs every workload on every shell under both engines.
+ *****************************************************************************/
+int main(int argc, char ** argv){
+	char self[4096];
+	char * default_shell[] = { "./smallsh" };
+	char ** shells = default_shell;
+	int num_shells = 1;
+	long n = 2000;
+	ssize_t length;
+	int i = 1;
+	int j;
+	size_t k;
+	if(argc > 1 && strcmp(argv[1], "--stamp") == 0){
+		print_stamp();
+		return 0;
+	}
+	if(argc > 2 && strcmp(argv[1], "-n") == 0){
+		n = atol(argv[2]);
+		i = 3;
+	}
+	if(n < 20)
+		n = 20;
+	if(i < argc){
+		shells = argv + i;
+		num_shells = argc - i;
+	}
+	// the reap jobs run this program again
+	length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if(length < 0){
+		fprintf(stderr, "smallsh_bench: can't find myself: %s\n", strerror(errno));
+		return 1;
+	}
+	self[length] = '\0';
+	if(mkdtemp(script_dir) == NULL){
+		fprintf(stderr, "smallsh_bench: %s: %s\n", script_dir, strerror(errno));
+		return 1;
+	}
+	// the shells' children may die while we still write to them
+	signal(SIGPIPE, SIG_IGN);
+	// show each result as soon as it is in
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	for(j = 0; j < num_shells; j++){
+		for(k = 0; k < sizeof(engines) / sizeof(engines[0]); k++){
+			for(i = 0; i < (int)(sizeof(workloads) / sizeof(workloads[0])); i++)
+				run_workload(shells[j], engines[k], &workloads[i], n);
+			run_reap(shells[j], engines[k], self, n / 20);
+		}
+	}
+	// clean up the scripts
+	for(i = 0; i < (int)(sizeof(workloads) / sizeof(workloads[0])); i++)
+		remove_file(workloads[i].name);
+	remove_file("out");
+	rmdir(script_dir);
+	return 0;
+}
@@ -0,0 +1,175 @@
+/******************************************************************************
+ * smallsh_test.c
+ *
+ * Description: Tests for smallsh. Runs one or more shell binaries under
+ * both launch engines on scripts whose effects can be checked afterwards,
+ * and prints one row per shell, engine and check.
+ *
+ * Build it next to the shell and run it on one binary or several:
+ *
+ *     gcc -O2 -o smallsh smallsh.c
+ *     gcc -O2 -o smallsh_test smallsh_test.c
+ *     ./smallsh_test [SHELL ...]
+ *
+ * SHELL defaults to ./smallsh. The checks are:
+ *
+ *   fds       several numbered redirects on one command land on the right
+ *             descriptors, even when one file is opened on a descriptor
+ *             that another redirect of the command targets
+ *
+ * The scripts are written to a temporary directory and given to the shell
+ * as its stdin with the output thrown away. The exit code is 1 if any check
+ * failed.
+ *****************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+
+// Launch engines the shell is run with, see SMALLSH_ENGINE
+static const char * engines[] = { "spawn", "fork" };
+
+// Function declarators
+int run_script(const char *, const char *, const char *);
+int check_fds(const char *, const char *, const char *);
+void write_fds(char **);
+
+static char script_dir[] = "/tmp/smallsh_test.XXXXXX";
+
+/******************************************************************************
+ * int run_script(const char *, const char *, const char *)
+ *
+ * Runs the shell with the engine and the script as its stdin, with the
+ * output thrown away. Returns 0 if it ran and -1 if it couldn't be run.
+ *****************************************************************************/
+int run_script(const char * shell, const char * engine, const char * script){
+	int status;
+	pid_t pid = fork();
+	if(pid < 0)
+		return -1;
+	if(pid == 0){
+		int null_fd = open("/dev/null", O_RDWR);
+		int script_fd = open(script, O_RDONLY);
+		dup2(script_fd, 0);
+		dup2(null_fd, 1);
+		dup2(null_fd, 2);
+		setenv("SMALLSH_ENGINE", engine, 1);
+		execl(shell, shell, (char *)NULL);
+		_exit(127);
+	}
+	waitpid(pid, &status, 0);
+	if(!WIFEXITED(status) || WEXITSTATUS(status) == 127)
+		return -1;
+	return 0;
+}
+
+/******************************************************************************
+ * int check_fds(const char *, const char *, const char *)
+ *
+ * Runs this program under the shell with redirects of descriptors 3 to 9
+ * from the top down, so whichever free descriptor the first file is opened
+ * on is one a later redirect targets. Checks that every descriptor ended up
+ * on its own file. Prints one row saying whether it did, and returns 0 if
+ * it did and -1 if not.
+ *****************************************************************************/
+int check_fds(const char * shell, const char * engine, const char * self){
+	// how many redirects there are, then the redirects in the order given
+	static const int cases[][8] = { { 7, 9, 8, 7, 6, 5, 4, 3 }, { 2, 5, 4 } };
+	char path[sizeof(script_dir) + 32];
+	char expected[16];
+	char got[16];
+	FILE * script;
+	FILE * file;
+	int failed = 0;
+	size_t i = 0;
+	int j;
+	snprintf(path, sizeof(path), "%s/fds", script_dir);
+	script = fopen(path, "w");
+	if(script == NULL){
+		fprintf(stderr, "smallsh_test: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	for(; i < sizeof(cases) / sizeof(cases[0]); i++){
+		fprintf(script, "%s --write-fds", self);
+		for(j = 1; j <= cases[i][0]; j++)
+			fprintf(script, " %d", cases[i][j]);
+		for(j = 1; j <= cases[i][0]; j++)
+			fprintf(script, " %d> %s/fd%zu.%d", cases[i][j], script_dir, i, cases[i][j]);
+		fprintf(script, "\n");
+	}
+	fclose(script);
+	if(run_script(shell, engine, path) < 0)
+		failed = 1;
+	unlink(path);
+	for(i = 0; i < sizeof(cases) / sizeof(cases[0]); i++){
+		for(j = 1; j <= cases[i][0]; j++){
+			snprintf(path, sizeof(path), "%s/fd%zu.%d", script_dir, i, cases[i][j]);
+			snprintf(expected, sizeof(expected), "fd %d\n", cases[i][j]);
+			file = fopen(path, "r");
+			if(file == NULL || fgets(got, sizeof(got), file) == NULL || strcmp(got, expected) != 0)
+				failed = 1;
+			if(file != NULL)
+				fclose(file);
+			unlink(path);
+		}
+	}
+	printf("%-20s %-6s %-9s %s\n", shell, engine, "fds", failed ? "FAILED" : "ok");
+	return failed ? -1 : 0;
+}
+
+/******************************************************************************
+ * void write_fds(char **)
+ *
+ * What the fds check runs: writes fd N to each descriptor N it is given.
+ *****************************************************************************/
+void write_fds(char ** fds){
+	for(; *fds != NULL; fds++)
+		dprintf(atoi(*fds), "fd %d\n", atoi(*fds));
+}
+
+/******************************************************************************
+ * int main(int, char **)
+ *
+ * main method. runs every check on every shell under both engines.
+ *****************************************************************************/
+int main(int argc, char ** argv){
+	char self[4096];
+	char * default_shell[] = { "./smallsh" };
+	char ** shells = default_shell;
+	int num_shells = 1;
+	int failed = 0;
+	ssize_t length;
+	int j = 0;
+	size_t k;
+	if(argc > 1 && strcmp(argv[1], "--write-fds") == 0){
+		write_fds(argv + 2);
+		return 0;
+	}
+	if(argc > 1){
+		shells = argv + 1;
+		num_shells = argc - 1;
+	}
+	// the checks run this program again
+	length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if(length < 0){
+		fprintf(stderr, "smallsh_test: can't find myself: %s\n", strerror(errno));
+		return 1;
+	}
+	self[length] = '\0';
+	if(mkdtemp(script_dir) == NULL){
+		fprintf(stderr, "smallsh_test: %s: %s\n", script_dir, strerror(errno));
+		return 1;
+	}
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	for(; j < num_shells; j++)
+		for(k = 0; k < sizeof(engines) / sizeof(engines[0]); k++)
+			if(check_fds(shells[j], engines[k], self) < 0)
+				failed = 1;
+	rmdir(script_dir);
+	return failed;
+}